@@ -1,8 +1,18 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <fs.h>
+#include <fs_format.h>
 
 #define ASSERT(cond, func)                               \
 do {                                                     \
@@ -232,6 +242,988 @@ int checkRead(const char *diskname){
 	return 0;
 }
 
+// write a few blocks to a new file, overwrite some bytes across a block
+// boundary and read it all back after a remount, both mounts using @opts
+void roundTrip(const char *diskname, const struct fs_options *opts){
+	int ret;
+	int fd;
+	static char data[3 * 4096 + 10];
+	static char buf[sizeof(data)];
+	char *filename = "roundtrip";
+
+	for(size_t i = 0; i < sizeof(data); i++){
+		data[i] = 'a' + i % 17;
+	}
+
+	ret = fs_mount_opts(diskname, opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	fs_lseek(fd, 4090);
+	ret = fs_write(fd, "0123456789ab", 12);
+	ASSERT(ret == 12, "fs_write");
+	memcpy(data + 4090, "0123456789ab", 12);
+	fs_close(fd);
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+
+	ret = fs_mount_opts(diskname, opts);
+	ASSERT(!ret, "fs_mount_opts");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf), "fs_read");
+	ASSERT(!memcmp(buf, data, sizeof(data)), "fs_read");
+	fs_close(fd);
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+}
+
+int checkMmap(const char *diskname){
+	struct fs_options opts = { .flags = FS_MOUNT_MMAP };
+
+	roundTrip(diskname, &opts);
+
+	return 0;
+}
+
+int checkCache(const char *diskname){
+	int ret;
+	int fd;
+	char data[4096];
+	struct fs_cache_stats stats;
+	struct fs_options opts = { .cache_blocks = 8 };
+
+	roundTrip(diskname, &opts);
+
+	// a block just written is read back from the cache
+	memset(data, 'c', sizeof(data));
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create("cached");
+	ASSERT(!ret, "fs_create");
+	fd = fs_open("cached");
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_read");
+	ret = fs_cache_stats(&stats);
+	ASSERT(!ret && stats.hits > 0, "fs_cache_stats");
+	fs_close(fd);
+	ret = fs_delete("cached");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+int checkUring(const char *diskname){
+	struct fs_options opts = { .flags = FS_MOUNT_URING };
+	struct fs_options cached = { .flags = FS_MOUNT_URING, .cache_blocks = 8 };
+
+	roundTrip(diskname, &opts);
+	roundTrip(diskname, &cached);
+
+	return 0;
+}
+
+int checkDirect(const char *diskname){
+	struct fs_options opts = { .flags = FS_MOUNT_DIRECT };
+	struct fs_options cached = { .flags = FS_MOUNT_DIRECT, .cache_blocks = 8 };
+	struct fs_options batched = { .flags = FS_MOUNT_DIRECT | FS_MOUNT_URING };
+
+	roundTrip(diskname, &opts);
+	roundTrip(diskname, &cached);
+	roundTrip(diskname, &batched);
+
+	return 0;
+}
+
+// data blocks of file @filename, read from the image; return how many there
+// are, up to @max
+int fileBlocks(const char *diskname, const char *filename, uint16_t *blocks, int max){
+	sb super;
+	rd root[FS_FILE_MAX_COUNT];
+	int disk = open(diskname, O_RDONLY);
+	ASSERT(disk >= 0, "open");
+
+	ASSERT(pread(disk, &super, sizeof(super), 0) == sizeof(super), "pread");
+	size_t fatSize = (size_t)super.fatBlkAmt * BLOCK_SIZE;
+	uint16_t *fat = malloc(fatSize);
+	ASSERT(fat != NULL, "malloc");
+	ASSERT(pread(disk, fat, fatSize, BLOCK_SIZE) == (ssize_t)fatSize, "pread");
+	ASSERT(pread(disk, root, sizeof(root), (off_t)super.rootIndex * BLOCK_SIZE) == sizeof(root), "pread");
+	close(disk);
+
+	int i = 0;
+	while(i < FS_FILE_MAX_COUNT && strcmp(root[i].filename, filename) != 0){
+		i++;
+	}
+	ASSERT(i < FS_FILE_MAX_COUNT, "file in the root directory");
+
+	int count = 0;
+	uint16_t curr = root[i].index_first;
+	while(curr < super.dataBlkAmt && count < max){
+		blocks[count++] = curr;
+		curr = fat[curr];
+	}
+	free(fat);
+
+	return count;
+}
+
+int checkFallocate(const char *diskname){
+	int ret;
+	int fd[2];
+	uint16_t blocks[8];
+	static char data[6 * 4096];
+	char *filename = "extent";
+
+	memset(data, 'e', sizeof(data));
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+
+	// leave one block holes all over the free space
+	ret = fs_create("kept");
+	ASSERT(!ret, "fs_create");
+	ret = fs_create("hole");
+	ASSERT(!ret, "fs_create");
+	fd[0] = fs_open("kept");
+	fd[1] = fs_open("hole");
+	ASSERT(fd[0] >= 0 && fd[1] >= 0, "fs_open");
+	for(int i = 0; i < 8; i++){
+		ret = fs_write(fd[i % 2], data, 4096);
+		ASSERT(ret == 4096, "fs_write");
+	}
+	fs_close(fd[0]);
+	fs_close(fd[1]);
+	ret = fs_delete("hole");
+	ASSERT(!ret, "fs_delete");
+
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd[0] = fs_open(filename);
+	ASSERT(fd[0] >= 0, "fs_open");
+	ret = fs_fallocate(fd[0], sizeof(data) / 2);
+	ASSERT(!ret, "fs_fallocate");
+	ASSERT(fs_stat(fd[0]) == 0, "fs_fallocate keeps the size");
+	// a larger reservation continues the extent
+	ret = fs_fallocate(fd[0], sizeof(data));
+	ASSERT(!ret, "fs_fallocate");
+	ret = fs_write(fd[0], data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	ASSERT(fs_stat(fd[0]) == sizeof(data), "fs_write");
+	fs_close(fd[0]);
+	fs_umount();
+
+	// the reserved blocks form one extent, and the write used them
+	ret = fileBlocks(diskname, filename, blocks, 8);
+	ASSERT(ret == 6, "write fills the reservation");
+	for(int i = 1; i < 6; i++){
+		ASSERT(blocks[i] == blocks[0] + i, "reservation is one extent");
+	}
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	ret = fs_delete("kept");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+// whether the @len bytes of @pattern are anywhere in image @diskname
+int imageHolds(const char *diskname, const void *pattern, size_t len){
+	struct stat st;
+	int found = 0;
+	int disk = open(diskname, O_RDONLY);
+	ASSERT(disk >= 0 && fstat(disk, &st) == 0, "open");
+
+	char *image = malloc(st.st_size);
+	ASSERT(image != NULL, "malloc");
+	ASSERT(pread(disk, image, st.st_size, 0) == st.st_size, "pread");
+	close(disk);
+
+	char *end = image + st.st_size - len + 1;
+	char *at = image;
+	while(!found && at < end && (at = memchr(at, *(const char*)pattern, end - at)) != NULL){
+		found = !memcmp(at, pattern, len);
+		at++;
+	}
+	free(image);
+
+	return found;
+}
+
+int checkLazy(const char *diskname){
+	int ret;
+	int fd;
+	char filename[FS_FILENAME_LEN];
+	struct fs_options opts = { .flags = FS_MOUNT_LAZY };
+
+	// a name no earlier run left on the disk, looked for with its terminator
+	snprintf(filename, sizeof(filename), "lazy%d", (int)getpid());
+
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(!imageHolds(diskname, filename, strlen(filename) + 1), "root entry kept in memory");
+	ret = fs_fsync(fd);
+	ASSERT(!ret, "fs_fsync");
+	ASSERT(imageHolds(diskname, filename, strlen(filename) + 1), "root entry written by fs_fsync");
+	fs_close(fd);
+
+	// a delete is not written back before fs_sync() either
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(fs_open(filename) < 0, "delete written by fs_umount");
+	fs_umount();
+
+	return 0;
+}
+
+// log a copy of the root directory where file @from is renamed @to, as if the
+// process died after committing it to the journal; with @torn, the copy does
+// not match the checksum, as if it died while logging it
+void journalLogRename(const char *diskname, const char *from, const char *to, int torn){
+	sb super;
+	rd root[FS_FILE_MAX_COUNT];
+	jh header = {0};
+	int disk = open(diskname, O_RDWR);
+	ASSERT(disk >= 0, "open");
+
+	ASSERT(pread(disk, &super, sizeof(super), 0) == sizeof(super), "pread");
+	ASSERT(super.journalBlkAmt != 0, "journal reserved");
+
+	ASSERT(pread(disk, root, sizeof(root), (off_t)super.rootIndex * BLOCK_SIZE) == sizeof(root), "pread");
+	int i = 0;
+	while(i < FS_FILE_MAX_COUNT && strcmp(root[i].filename, from) != 0){
+		i++;
+	}
+	ASSERT(i < FS_FILE_MAX_COUNT, "file to rename");
+	memset(root[i].filename, 0, FS_FILENAME_LEN);
+	strcpy(root[i].filename, to);
+
+	memcpy(header.signature, JOURNAL_SIGNATURE, sizeof(header.signature));
+	header.checksum = fs_journal_sum(JOURNAL_SUM_SEED, root, sizeof(root));
+	header.count = 1;
+	header.targets[0] = super.rootIndex;
+	if(torn){
+		root[FS_FILE_MAX_COUNT - 1].padding[9] ^= 1;
+	}
+
+	ASSERT(pwrite(disk, root, sizeof(root), (off_t)(super.journalIndex + 1) * BLOCK_SIZE) == sizeof(root), "pwrite");
+	ASSERT(pwrite(disk, &header, sizeof(header), (off_t)super.journalIndex * BLOCK_SIZE) == sizeof(header), "pwrite");
+	close(disk);
+}
+
+int checkJournal(const char *diskname){
+	int ret;
+	int fd;
+	struct fs_options opts = { .flags = FS_MOUNT_JOURNAL };
+
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create("before");
+	ASSERT(!ret, "fs_create");
+	fs_umount();
+
+	// a committed group is replayed
+	journalLogRename(diskname, "before", "after", 0);
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(fs_open("before") < 0, "committed group replayed");
+	fd = fs_open("after");
+	ASSERT(fd >= 0, "committed group replayed");
+	fs_close(fd);
+	fs_umount();
+
+	// a torn one is dropped
+	journalLogRename(diskname, "after", "torn", 1);
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(fs_open("torn") < 0, "torn group dropped");
+	fd = fs_open("after");
+	ASSERT(fd >= 0, "torn group dropped");
+	fs_close(fd);
+	ret = fs_delete("after");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+// number of free data blocks, found by reserving space for a probe file
+int freeBlocks(void){
+	int lo = 0;
+	int hi = 65536;
+
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		ASSERT(!fs_create("probe"), "fs_create");
+		int fd = fs_open("probe");
+		ASSERT(fd >= 0, "fs_open");
+		int ret = fs_fallocate(fd, (size_t)mid * 4096);
+		fs_close(fd);
+		ASSERT(!fs_delete("probe"), "fs_delete");
+		if(ret == 0){
+			lo = mid;
+		}else{
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
+
+// create file @filename with @count blocks of data and delete it
+void writeAndDelete(const char *filename, int count){
+	int ret;
+	int fd;
+	char data[4096];
+
+	memset(data, 'd', sizeof(data));
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	for(int i = 0; i < count; i++){
+		ret = fs_write(fd, data, sizeof(data));
+		ASSERT(ret == sizeof(data), "fs_write");
+	}
+	fs_close(fd);
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+}
+
+int checkDeferFree(const char *diskname){
+	int ret;
+	int before;
+	struct fs_options opts = { .flags = FS_MOUNT_DEFER_FREE };
+	int status;
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	before = freeBlocks();
+	fs_umount();
+
+	// fs_reclaim() releases the blocks left by fs_delete(), at most as many
+	// as asked
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	writeAndDelete("deferred", 4);
+	ret = fs_reclaim(1);
+	ASSERT(ret == 1, "fs_reclaim one block");
+	ret = fs_reclaim(0);
+	ASSERT(ret == 3, "fs_reclaim the rest");
+	ret = fs_reclaim(0);
+	ASSERT(ret == 0, "fs_reclaim nothing left");
+
+	// fs_umount() releases the ones still pending
+	writeAndDelete("deferred", 4);
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(freeBlocks() == before, "pending blocks released by fs_umount");
+	fs_umount();
+
+	// so does the next mount when the process dies before either
+	pid_t pid = fork();
+	ASSERT(pid >= 0, "fork");
+	if(pid == 0){
+		ret = fs_mount_opts(diskname, &opts);
+		ASSERT(!ret, "fs_mount_opts");
+		writeAndDelete("deferred", 4);
+		_exit(0);
+	}
+	ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "child deleting without unmounting");
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(freeBlocks() == before, "pending blocks released by the next mount");
+	fs_umount();
+
+	return 0;
+}
+
+// copy image @from to @to
+void copyImage(const char *from, const char *to){
+	char buf[4096];
+	ssize_t len;
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT(in >= 0 && out >= 0, "open");
+
+	while((len = read(in, buf, sizeof(buf))) > 0){
+		ASSERT(write(out, buf, len) == len, "write");
+	}
+	ASSERT(len == 0, "read");
+	close(in);
+	close(out);
+}
+
+struct ctxWrite {
+	fs_ctx *ctx;
+	char fill;
+};
+
+// fill file "shared" of the context with its own byte, block by block
+void *ctxWriter(void *arg){
+	struct ctxWrite *job = arg;
+	char data[4096];
+
+	memset(data, job->fill, sizeof(data));
+	int fd = fs_open_ctx(job->ctx, "shared");
+	ASSERT(fd >= 0, "fs_open_ctx");
+	for(int i = 0; i < 8; i++){
+		ASSERT(fs_write_ctx(job->ctx, fd, data, sizeof(data)) == sizeof(data), "fs_write_ctx");
+	}
+	fs_close_ctx(job->ctx, fd);
+
+	return NULL;
+}
+
+int checkContexts(const char *diskname){
+	int ret;
+	int fd;
+	char copy[256];
+	char data[8 * 4096];
+	pthread_t threads[2];
+	struct ctxWrite jobs[2] = { { NULL, '1' }, { NULL, '2' } };
+
+	snprintf(copy, sizeof(copy), "%s.ctx", diskname);
+	copyImage(diskname, copy);
+
+	// the same file name on two disks mounted at once, written concurrently
+	jobs[0].ctx = fs_mount_ctx(diskname, NULL);
+	jobs[1].ctx = fs_mount_ctx(copy, NULL);
+	ASSERT(jobs[0].ctx != NULL && jobs[1].ctx != NULL, "fs_mount_ctx");
+	for(int i = 0; i < 2; i++){
+		ret = fs_create_ctx(jobs[i].ctx, "shared");
+		ASSERT(!ret, "fs_create_ctx");
+	}
+	ret = fs_create_ctx(jobs[0].ctx, "only-first");
+	ASSERT(!ret, "fs_create_ctx");
+	for(int i = 0; i < 2; i++){
+		ASSERT(!pthread_create(&threads[i], NULL, ctxWriter, &jobs[i]), "pthread_create");
+	}
+	for(int i = 0; i < 2; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	// each disk only holds what was written to it
+	ASSERT(fs_open_ctx(jobs[1].ctx, "only-first") < 0, "contexts share no files");
+	for(int i = 0; i < 2; i++){
+		fd = fs_open_ctx(jobs[i].ctx, "shared");
+		ASSERT(fd >= 0, "fs_open_ctx");
+		ret = fs_read_ctx(jobs[i].ctx, fd, data, sizeof(data));
+		ASSERT(ret == sizeof(data), "fs_read_ctx");
+		for(size_t j = 0; j < sizeof(data); j++){
+			ASSERT(data[j] == jobs[i].fill, "contexts share no blocks");
+		}
+		fs_close_ctx(jobs[i].ctx, fd);
+		ret = fs_delete_ctx(jobs[i].ctx, "shared");
+		ASSERT(!ret, "fs_delete_ctx");
+	}
+	ret = fs_delete_ctx(jobs[0].ctx, "only-first");
+	ASSERT(!ret, "fs_delete_ctx");
+	for(int i = 0; i < 2; i++){
+		ret = fs_umount_ctx(jobs[i].ctx);
+		ASSERT(!ret, "fs_umount_ctx");
+	}
+
+	// the default context still holds a single disk
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_mount(copy);
+	ASSERT(ret, "second fs_mount refused");
+	fs_umount();
+	unlink(copy);
+
+	return 0;
+}
+
+int checkPositional(const char *diskname){
+	int ret;
+	int fd;
+	char data[26] = "abcdefghijklmnopqrstuvwxyz";
+	char buf[26];
+	char *filename = "positional";
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+
+	fs_lseek(fd, 5);
+	ret = fs_pwrite(fd, "XYZ", 3, 10);
+	ASSERT(ret == 3, "fs_pwrite");
+	ret = fs_pread(fd, buf, 5, 9);
+	ASSERT(ret == 5, "fs_pread");
+	ASSERT(!strncmp(buf, "jXYZn", 5), "fs_pread");
+	ret = fs_pread(fd, buf, 5, 26);
+	ASSERT(ret == 0, "fs_pread");
+
+	// neither of them moved the offset
+	ret = fs_read(fd, buf, 8);
+	ASSERT(ret == 8, "fs_read");
+	ASSERT(!strncmp(buf, "fghijXYZ", 8), "fs_read");
+
+	fs_close(fd);
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+int checkVectored(const char *diskname){
+	int ret;
+	int fd;
+	static char data[3 * 4096 + 100];
+	static char plain[sizeof(data)];
+	static char gathered[sizeof(data)];
+
+	for(size_t i = 0; i < sizeof(data); i++){
+		data[i] = 'a' + i % 23;
+	}
+	// buffers of every kind of size, crossing block boundaries
+	struct iovec iov[5] = {
+		{ data, 1 },
+		{ data + 1, 4102 },
+		{ data + 4103, 0 },
+		{ data + 4103, 5000 },
+		{ data + 9103, sizeof(data) - 9103 }
+	};
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+
+	ret = fs_create("plain");
+	ASSERT(!ret, "fs_create");
+	fd = fs_open("plain");
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, plain, sizeof(plain));
+	ASSERT(ret == sizeof(plain), "fs_read");
+	fs_close(fd);
+
+	ret = fs_create("gathered");
+	ASSERT(!ret, "fs_create");
+	fd = fs_open("gathered");
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_writev(fd, iov, 5);
+	ASSERT(ret == sizeof(data), "fs_writev");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, gathered, sizeof(gathered));
+	ASSERT(ret == sizeof(gathered), "fs_read");
+	ASSERT(!memcmp(plain, gathered, sizeof(plain)), "fs_writev");
+
+	// scatter the file back over the same buffers
+	memset(data, 0, sizeof(data));
+	fs_lseek(fd, 0);
+	ret = fs_readv(fd, iov, 5);
+	ASSERT(ret == sizeof(data), "fs_readv");
+	ASSERT(!memcmp(data, plain, sizeof(data)), "fs_readv");
+	fs_close(fd);
+
+	ret = fs_delete("plain");
+	ASSERT(!ret, "fs_delete");
+	ret = fs_delete("gathered");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+pthread_mutex_t aioLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aioDone = PTHREAD_COND_INITIALIZER;
+
+// completion callback, counts the completed requests in the int @aio->data
+// points to
+void aioCallback(struct fs_aio *aio){
+	pthread_mutex_lock(&aioLock);
+	(*(int*)aio->data)++;
+	pthread_cond_signal(&aioDone);
+	pthread_mutex_unlock(&aioLock);
+}
+
+int checkAsync(const char *diskname){
+	int ret;
+	int fd;
+	int completed = 0;
+	static char data[2 * 4096];
+	static char buf[2][4096];
+	char *filename = "async";
+
+	for(size_t i = 0; i < sizeof(data); i++){
+		data[i] = 'a' + i % 19;
+	}
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+
+	struct fs_aio write = { .fd = fd, .buf = data, .count = sizeof(data), .offset = 0 };
+	ret = fs_write_async(&write);
+	ASSERT(!ret, "fs_write_async");
+	ret = fs_aio_wait(&write);
+	ASSERT(ret == sizeof(data), "fs_aio_wait");
+	ASSERT(fs_aio_poll(&write) == 1 && write.result == sizeof(data), "fs_aio_poll");
+
+	// one read per block, completed through the callback
+	struct fs_aio read[2];
+	for(int i = 0; i < 2; i++){
+		read[i] = (struct fs_aio){ .fd = fd, .buf = buf[i], .count = 4096, .offset = i * 4096,
+			.callback = aioCallback, .data = &completed };
+		ret = fs_read_async(&read[i]);
+		ASSERT(!ret, "fs_read_async");
+	}
+	pthread_mutex_lock(&aioLock);
+	while(completed < 2){
+		pthread_cond_wait(&aioDone, &aioLock);
+	}
+	pthread_mutex_unlock(&aioLock);
+	for(int i = 0; i < 2; i++){
+		ASSERT(read[i].result == 4096, "fs_read_async");
+		ASSERT(!memcmp(buf[i], data + i * 4096, 4096), "fs_read_async");
+	}
+
+	// past the end of the file, as fs_pread() would
+	struct fs_aio past = { .fd = fd, .buf = buf[0], .count = 10, .offset = sizeof(data) };
+	ret = fs_read_async(&past);
+	ASSERT(!ret, "fs_read_async");
+	ASSERT(fs_aio_wait(&past) == 0, "fs_aio_wait");
+
+	fs_close(fd);
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+int checkOpenMax(const char *diskname){
+	int ret;
+	int fd[2 * FS_OPEN_MAX_COUNT];
+	struct fs_options opts = { .open_max = 2 * FS_OPEN_MAX_COUNT };
+
+	// a larger table, still bounded
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create("many");
+	ASSERT(!ret, "fs_create");
+	for(int i = 0; i < 2 * FS_OPEN_MAX_COUNT; i++){
+		fd[i] = fs_open("many");
+		ASSERT(fd[i] >= 0, "open_max descriptors open");
+	}
+	ASSERT(fs_open("many") < 0, "open_max enforced");
+	for(int i = 0; i < 2 * FS_OPEN_MAX_COUNT; i++){
+		fs_close(fd[i]);
+	}
+	fs_umount();
+
+	// the default one
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		fd[i] = fs_open("many");
+		ASSERT(fd[i] >= 0, "FS_OPEN_MAX_COUNT descriptors open");
+	}
+	ASSERT(fs_open("many") < 0, "FS_OPEN_MAX_COUNT enforced");
+	for(int i = 1; i < FS_OPEN_MAX_COUNT; i++){
+		fs_close(fd[i]);
+	}
+
+	// only the file being deleted has to be closed
+	ret = fs_create("other");
+	ASSERT(!ret, "fs_create");
+	ret = fs_delete("other");
+	ASSERT(!ret, "fs_delete with another file open");
+	ret = fs_delete("many");
+	ASSERT(ret, "fs_delete of an open file refused");
+	fs_close(fd[0]);
+	ret = fs_delete("many");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+int checkFlusher(const char *diskname){
+	int ret;
+	int fd;
+	int held = 0;
+	char data[4096];
+	struct fs_cache_stats stats;
+	struct fs_options opts = { .flags = FS_MOUNT_FLUSH, .cache_blocks = 16, .flush_age_ms = 20 };
+
+	// a block no earlier run left on the disk
+	memset(data, 'f', sizeof(data));
+	snprintf(data, sizeof(data), "flush%d", (int)getpid());
+
+	ret = fs_mount_opts(diskname, &opts);
+	ASSERT(!ret, "fs_mount_opts");
+	ret = fs_create("flushed");
+	ASSERT(!ret, "fs_create");
+	fd = fs_open("flushed");
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+
+	// the flusher writes it back on its own, well within a second
+	for(int i = 0; i < 100 && !held; i++){
+		usleep(10000);
+		held = imageHolds(diskname, data, sizeof(data));
+	}
+	ASSERT(held, "block written back by the flusher");
+	ret = fs_cache_stats(&stats);
+	ASSERT(!ret && stats.flushes > 0 && stats.dirty == 0, "flusher counters");
+
+	fs_close(fd);
+	ret = fs_delete("flushed");
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+// free data block count reported by fs_info()
+int infoFree(void){
+	char line[128];
+	int count = -1;
+	int total;
+	FILE *out = tmpfile();
+	ASSERT(out != NULL, "tmpfile");
+
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	dup2(fileno(out), STDOUT_FILENO);
+	ASSERT(!fs_info(), "fs_info");
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	rewind(out);
+	while(fgets(line, sizeof(line), out) != NULL){
+		sscanf(line, "fat_free_ratio=%d/%d", &count, &total);
+	}
+	fclose(out);
+
+	return count;
+}
+
+// read or write @len bytes at offset @offset of the superblock of the image
+void superblockIo(const char *diskname, void *buf, size_t len, off_t offset, int write){
+	int disk = open(diskname, O_RDWR);
+	ASSERT(disk >= 0, "open");
+	if(write){
+		ASSERT(pwrite(disk, buf, len, offset) == (ssize_t)len, "pwrite");
+	}else{
+		ASSERT(pread(disk, buf, len, offset) == (ssize_t)len, "pread");
+	}
+	close(disk);
+}
+
+int checkCounters(const char *diskname){
+	int ret;
+	int fd;
+	int before;
+	uint16_t fatFree;
+	uint8_t clean;
+	static char data[3 * 4096];
+	char *filename = "counted";
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+
+	// the first update written back clears the clean flag on disk
+	ret = fs_sync();
+	ASSERT(!ret, "fs_sync");
+	superblockIo(diskname, &clean, sizeof(clean), offsetof(sb, clean), 0);
+	ASSERT(clean == 0, "clean flag cleared by an update");
+
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	fs_close(fd);
+	before = infoFree();
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+
+	superblockIo(diskname, &fatFree, sizeof(fatFree), offsetof(sb, fatFree), 0);
+	superblockIo(diskname, &clean, sizeof(clean), offsetof(sb, clean), 0);
+	ASSERT(clean == 1 && fatFree == before, "counters saved by fs_umount");
+
+	// a clean disk is mounted with the saved counter, even when it is wrong
+	fatFree = before - 1;
+	superblockIo(diskname, &fatFree, sizeof(fatFree), offsetof(sb, fatFree), 1);
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(infoFree() == before - 1, "saved fatFree trusted");
+	fs_umount();
+
+	// any other one is counted
+	clean = 0;
+	superblockIo(diskname, &clean, sizeof(clean), offsetof(sb, clean), 1);
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ASSERT(infoFree() == before, "unclean disk recounted");
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
+// resident size in bytes of the mappings of the file with inode @ino
+size_t mappedRss(ino_t ino){
+	char line[512];
+	size_t rss = 0;
+	int found = 0;
+	int inside = 0;
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	ASSERT(smaps != NULL, "fopen");
+
+	while(fgets(line, sizeof(line), smaps) != NULL){
+		unsigned long start, end, offset, inode;
+		unsigned int major, minor;
+		char perms[8];
+		size_t kb;
+		if(sscanf(line, "%lx-%lx %7s %lx %x:%x %lu", &start, &end, perms, &offset, &major, &minor, &inode) == 7){
+			inside = (inode == ino);
+			found |= inside;
+		}else if(inside && sscanf(line, "Rss: %zu kB", &kb) == 1){
+			rss += kb * 1024;
+		}
+	}
+	fclose(smaps);
+	ASSERT(found, "FAT mapped");
+
+	return rss;
+}
+
+// drop image @diskname from the host page cache; return 0 if that worked
+// and the image supports direct I/O, so that only the pages of the FAT
+// mapping that are accessed get read back, -1 otherwise
+int evictImage(const char *diskname){
+	struct stat st;
+	unsigned char *resident;
+	int disk = open(diskname, O_RDONLY | O_DIRECT);
+	if(disk < 0){
+		return -1;
+	}
+	ASSERT(fstat(disk, &st) == 0, "fstat");
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t pages = (st.st_size + page - 1) / page;
+	int ret = fdatasync(disk) == 0 && posix_fadvise(disk, 0, 0, POSIX_FADV_DONTNEED) == 0 ? 0 : -1;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk, 0);
+	resident = malloc(pages);
+	ASSERT(map != MAP_FAILED && resident != NULL, "mmap");
+	ASSERT(mincore(map, st.st_size, resident) == 0, "mincore");
+	for(size_t i = 0; i < pages && ret == 0; i++){
+		if(resident[i] & 1){
+			ret = -1;
+		}
+	}
+	free(resident);
+	munmap(map, st.st_size);
+	close(disk);
+
+	return ret;
+}
+
+int checkPagedFat(const char *diskname){
+	int ret;
+	int fd;
+	int count;
+	int fatBlocks = 0;
+	uint16_t blocks[3];
+	struct stat st;
+	static char data[3 * 4096];
+	char *filename = "paged";
+	struct fs_options opts = { .flags = FS_MOUNT_PAGED_FAT | FS_MOUNT_DIRECT };
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_create(filename);
+	ASSERT(!ret, "fs_create");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write");
+	fs_close(fd);
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+
+	// FAT blocks the chain of the file crosses
+	count = fileBlocks(diskname, filename, blocks, 3);
+	ASSERT(count == 3, "fs_write");
+	for(int i = 0; i < count; i++){
+		if(i == 0 || blocks[i] / 2048 != blocks[i - 1] / 2048){
+			fatBlocks++;
+		}
+	}
+
+	// with a warm page cache, faulting one FAT page maps its cached
+	// neighbours too
+	if(evictImage(diskname) == -1){
+		printf("paged FAT check skipped: the image cannot be evicted from the page cache\n");
+	}else{
+		ASSERT(stat(diskname, &st) == 0, "stat");
+		ret = fs_mount_opts(diskname, &opts);
+		ASSERT(!ret, "fs_mount_opts");
+		fd = fs_open(filename);
+		ASSERT(fd >= 0, "fs_open");
+		ret = fs_read(fd, data, sizeof(data));
+		ASSERT(ret == sizeof(data), "fs_read");
+		size_t rss = mappedRss(st.st_ino);
+		ASSERT(rss > 0 && rss <= (size_t)fatBlocks * sysconf(_SC_PAGESIZE), "only the chain's FAT blocks read");
+		fs_close(fd);
+		fs_umount();
+	}
+
+	ret = fs_mount(diskname);
+	ASSERT(!ret, "fs_mount");
+	ret = fs_delete(filename);
+	ASSERT(!ret, "fs_delete");
+	fs_umount();
+
+	return 0;
+}
+
 
 
 int main(int argc, char *argv[])
@@ -249,7 +1241,7 @@ int main(int argc, char *argv[])
 	int check = -1;
 
 	while(check != 0){
-		printf("1 - Check mount\n2 - Check unmount\n3 - Check info\n4 - Check create\n5 - Check delete\n6 - Check ls\n7 - Check open\n8 - Check close\n9 - Check stat\n10 - Check write\n11 - Check read\n0 - Exit\n");
+		printf("1 - Check mount\n2 - Check unmount\n3 - Check info\n4 - Check create\n5 - Check delete\n6 - Check ls\n7 - Check open\n8 - Check close\n9 - Check stat\n10 - Check write\n11 - Check read\n12 - Check mmap backend\n13 - Check block cache\n14 - Check io_uring engine\n15 - Check direct I/O\n16 - Check fallocate\n17 - Check lazy metadata\n18 - Check journal replay\n19 - Check deferred free\n20 - Check several contexts\n21 - Check pread/pwrite\n22 - Check writev/readv\n23 - Check asynchronous requests\n24 - Check descriptor limits\n25 - Check background flusher\n26 - Check saved free counters\n27 - Check paged FAT\n0 - Exit\n");
 		if (scanf("%d", &check) != 1) {
         	// handle error
         	printf("Invalid input\n");
@@ -305,6 +1297,70 @@ int main(int argc, char *argv[])
 				checkRead(diskname);
 				printf("fs_read successful\n");
 				break;
+			case 12:
+				checkMmap(diskname);
+				printf("mmap backend successful\n");
+				break;
+			case 13:
+				checkCache(diskname);
+				printf("block cache successful\n");
+				break;
+			case 14:
+				checkUring(diskname);
+				printf("io_uring engine successful\n");
+				break;
+			case 15:
+				checkDirect(diskname);
+				printf("direct I/O successful\n");
+				break;
+			case 16:
+				checkFallocate(diskname);
+				printf("fs_fallocate successful\n");
+				break;
+			case 17:
+				checkLazy(diskname);
+				printf("lazy metadata successful\n");
+				break;
+			case 18:
+				checkJournal(diskname);
+				printf("journal replay successful\n");
+				break;
+			case 19:
+				checkDeferFree(diskname);
+				printf("deferred free successful\n");
+				break;
+			case 20:
+				checkContexts(diskname);
+				printf("several contexts successful\n");
+				break;
+			case 21:
+				checkPositional(diskname);
+				printf("fs_pread/fs_pwrite successful\n");
+				break;
+			case 22:
+				checkVectored(diskname);
+				printf("fs_writev/fs_readv successful\n");
+				break;
+			case 23:
+				checkAsync(diskname);
+				printf("fs_read_async/fs_write_async successful\n");
+				break;
+			case 24:
+				checkOpenMax(diskname);
+				printf("descriptor limits successful\n");
+				break;
+			case 25:
+				checkFlusher(diskname);
+				printf("background flusher successful\n");
+				break;
+			case 26:
+				checkCounters(diskname);
+				printf("saved free counters successful\n");
+				break;
+			case 27:
+				checkPagedFat(diskname);
+				printf("paged FAT successful\n");
+				break;
 			case 0:
 			printf("Ending program\n");
 				break;
@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define MAX_THREADS 32
+#define CHUNK 4096
+
+/* Shared by all the threads */
+static size_t file_size;
+static int rounds;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	char name[FS_FILENAME_LEN];
+	size_t bytes;
+	int errors;
+};
+
+static struct worker workers[MAX_THREADS];
+static int nthreads;
+
+/* Byte @off of the file written by thread @id */
+static char pattern(int id, size_t off)
+{
+	return (char)((id * 31 + off / 7) & 0xff);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill the thread's own file */
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	char buf[CHUNK];
+	int fd;
+
+	fd = fs_open(w->name);
+	if (fd < 0) {
+		w->errors++;
+		return NULL;
+	}
+
+	for (size_t off = 0; off < file_size; off += CHUNK) {
+		size_t len = file_size - off < CHUNK ? file_size - off : CHUNK;
+
+		for (size_t i = 0; i < len; i++)
+			buf[i] = pattern(w->id, off + i);
+		if (fs_write(fd, buf, len) != (int)len)
+			w->errors++;
+		w->bytes += len;
+	}
+
+	fs_close(fd);
+	return NULL;
+}
+
+/* Read back the files of all the threads, starting with the next one's */
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	char buf[CHUNK];
+
+	for (int r = 0; r < rounds; r++) {
+		for (int t = 0; t < nthreads; t++) {
+			struct worker *owner = &workers[(w->id + 1 + t) % nthreads];
+			int fd = fs_open(owner->name);
+
+			if (fd < 0) {
+				w->errors++;
+				continue;
+			}
+
+			for (size_t off = 0; off < file_size; off += CHUNK) {
+				size_t len = file_size - off < CHUNK ? file_size - off : CHUNK;
+
+				if (fs_read(fd, buf, len) != (int)len) {
+					w->errors++;
+					break;
+				}
+				for (size_t i = 0; i < len; i++) {
+					if (buf[i] != pattern(owner->id, off + i)) {
+						w->errors++;
+						break;
+					}
+				}
+				w->bytes += len;
+			}
+
+			fs_close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+/* Run @fn on every thread and report the aggregated throughput */
+static void run(const char *phase, void *(*fn)(void *))
+{
+	size_t bytes = 0;
+	int errors = 0;
+	double start = now();
+	double elapsed;
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].bytes = 0;
+		workers[i].errors = 0;
+		ASSERT(!pthread_create(&workers[i].thread, NULL, fn, &workers[i]),
+		       "pthread_create");
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+	}
+
+	elapsed = now() - start;
+	printf("%s: %d threads, %zu bytes in %.3f s (%.1f MB/s), %d errors\n",
+	       phase, nthreads, bytes, elapsed, bytes / elapsed / 1e6, errors);
+	ASSERT(!errors, phase);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_options opts = { 0, 0 };
+	int ret;
+
+	if (argc <= 1) {
+		printf("Usage: %s <diskimage> [threads] [kbytes per thread] "
+		       "[read rounds] [cache blocks] [mount flags]\n", argv[0]);
+		exit(1);
+	}
+
+	nthreads = argc > 2 ? atoi(argv[2]) : 4;
+	file_size = (argc > 3 ? atoi(argv[3]) : 256) * 1024;
+	rounds = argc > 4 ? atoi(argv[4]) : 4;
+	opts.cache_blocks = argc > 5 ? atoi(argv[5]) : 0;
+	opts.flags = argc > 6 ? strtol(argv[6], NULL, 0) : 0;
+	ASSERT(nthreads > 0 && nthreads <= MAX_THREADS, "threads");
+
+	ret = fs_mount_opts(argv[1], &opts);
+	ASSERT(!ret, "fs_mount_opts");
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		snprintf(workers[i].name, FS_FILENAME_LEN, "stress%d", i);
+		fs_delete(workers[i].name);
+		ret = fs_create(workers[i].name);
+		ASSERT(!ret, "fs_create");
+	}
+
+	run("write", writer);
+	run("read", reader);
+
+	for (int i = 0; i < nthreads; i++) {
+		ret = fs_delete(workers[i].name);
+		ASSERT(!ret, "fs_delete");
+	}
+
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+
+	return 0;
+}
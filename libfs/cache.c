@@ -0,0 +1,680 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a hash chain */
+#define NO_ENTRY -1
+
+/* Maximum number of blocks coalesced in a single vectored write-back */
+#define FLUSH_RUN_MAX 64
+
+/* Number of staging buffers kept in the pool */
+#define POOL_BUFS 4
+
+/* Cached block */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Entry holds a block */
+	int valid;
+	/* Block was modified since it was read from (or written to) the disk */
+	int dirty;
+	/* When the block became dirty, in nanoseconds */
+	uint64_t dirtied;
+	/* Value of the cache's write counter when the block was last modified */
+	uint64_t seq;
+	/* Block is being written back by cache_writeback(), cannot be evicted */
+	int busy;
+	/* CLOCK reference bit */
+	int ref;
+	/* Next entry in the same hash bucket */
+	int next;
+	/* Block content */
+	char *data;
+};
+
+/* Pool of aligned staging buffers */
+struct pool {
+	/* Buffers currently available */
+	void *free[POOL_BUFS];
+	/* Number of entries of @free in use */
+	int nfree;
+};
+
+/* Block cache description */
+struct cache {
+	/* Number of entries (0 when the cache is disabled) */
+	size_t nblocks;
+	/* Number of hash buckets */
+	size_t nbuckets;
+	/* Heads of the hash chains */
+	int *buckets;
+	/* Entries */
+	struct cache_entry *entries;
+	/* Storage for the content of all the entries */
+	char *data;
+	/* CLOCK hand */
+	size_t hand;
+	/* Counters */
+	struct cache_stats stats;
+	/* Number of writes to the cache so far */
+	uint64_t seq;
+	/* Number of entries being written back with the cache unlocked */
+	size_t busy;
+	/* Signaled when @busy drops to 0 */
+	pthread_cond_t idle;
+	/* Staging buffers for the transfers that do not fit in the cache */
+	struct pool pool;
+	/* Virtual disk the cache sits in front of */
+	struct disk *disk;
+	/* Serializes the users of the cache and of @pool */
+	pthread_mutex_t lock;
+};
+
+/* Dirty block picked by cache_writeback() */
+struct wb_item {
+	struct cache_entry *e;
+	size_t block;
+	uint64_t dirtied;
+};
+
+static int __cache_flush(struct cache *cache);
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cache_lookup(struct cache *cache, size_t block)
+{
+	int i = cache->buckets[block % cache->nbuckets];
+
+	while (i != NO_ENTRY && cache->entries[i].block != block)
+		i = cache->entries[i].next;
+
+	return i;
+}
+
+static void cache_unlink(struct cache *cache, int idx)
+{
+	int *link = &cache->buckets[cache->entries[idx].block % cache->nbuckets];
+
+	while (*link != idx)
+		link = &cache->entries[*link].next;
+	*link = cache->entries[idx].next;
+
+	cache->entries[idx].valid = 0;
+}
+
+static void cache_link(struct cache *cache, int idx, size_t block)
+{
+	int *head = &cache->buckets[block % cache->nbuckets];
+
+	cache->entries[idx].block = block;
+	cache->entries[idx].valid = 1;
+	cache->entries[idx].dirty = 0;
+	cache->entries[idx].ref = 1;
+	cache->entries[idx].next = *head;
+	*head = idx;
+}
+
+/*
+ * Find an entry to hold a new block using the CLOCK algorithm, writing back the
+ * victim if it is dirty. The returned entry is unlinked.
+ */
+static int cache_evict(struct cache *cache)
+{
+	struct cache_entry *e;
+	int idx;
+
+	for (;;) {
+		idx = cache->hand;
+		e = &cache->entries[idx];
+		cache->hand = (cache->hand + 1) % cache->nblocks;
+
+		if (!e->valid)
+			return idx;
+
+		/*
+		 * Entries being written back are skipped like referenced ones,
+		 * cache_writeback() leaves enough of the others to choose from
+		 */
+		if (e->ref || e->busy) {
+			e->ref = 0;
+			continue;
+		}
+
+		if (e->dirty) {
+			if (disk_write(cache->disk, e->block, e->data) == -1)
+				return NO_ENTRY;
+			e->dirty = 0;
+			cache->stats.dirty--;
+			cache->stats.writebacks++;
+		}
+
+		cache_unlink(cache, idx);
+		return idx;
+	}
+}
+
+struct cache *cache_init(struct disk *disk, size_t nblocks)
+{
+	struct cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		cache_error("cannot allocate cache");
+		return NULL;
+	}
+	cache->disk = disk;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->idle, NULL);
+	if (!nblocks)
+		return cache;
+
+	cache->nbuckets = 2 * nblocks + 1;
+	cache->buckets = malloc(cache->nbuckets * sizeof(*cache->buckets));
+	cache->entries = calloc(nblocks, sizeof(*cache->entries));
+	/* Entries are aligned so they can be used for direct I/O */
+	if (posix_memalign((void **)&cache->data, BLOCK_SIZE, nblocks * BLOCK_SIZE))
+		cache->data = NULL;
+	if (!cache->buckets || !cache->entries || !cache->data) {
+		cache_error("cannot allocate %zu blocks", nblocks);
+		free(cache->buckets);
+		free(cache->entries);
+		free(cache->data);
+		pthread_mutex_destroy(&cache->lock);
+		pthread_cond_destroy(&cache->idle);
+		free(cache);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < cache->nbuckets; i++)
+		cache->buckets[i] = NO_ENTRY;
+	for (size_t i = 0; i < nblocks; i++)
+		cache->entries[i].data = cache->data + i * BLOCK_SIZE;
+	cache->nblocks = nblocks;
+
+	return cache;
+}
+
+int cache_destroy(struct cache *cache)
+{
+	int ret = 0;
+
+	if (cache->nblocks) {
+		ret = __cache_flush(cache);
+		free(cache->buckets);
+		free(cache->entries);
+		free(cache->data);
+	}
+
+	for (int i = 0; i < cache->pool.nfree; i++)
+		free(cache->pool.free[i]);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->idle);
+	free(cache);
+
+	return ret;
+}
+
+int cache_read(struct cache *cache, size_t block, void *buf)
+{
+	int idx;
+	int ret = 0;
+
+	if (!cache->nblocks)
+		return disk_read(cache->disk, block, buf);
+
+	pthread_mutex_lock(&cache->lock);
+	idx = cache_lookup(cache, block);
+	if (idx != NO_ENTRY) {
+		cache->stats.hits++;
+		cache->entries[idx].ref = 1;
+		memcpy(buf, cache->entries[idx].data, BLOCK_SIZE);
+		goto out;
+	}
+
+	cache->stats.misses++;
+	idx = cache_evict(cache);
+	if (idx == NO_ENTRY ||
+	    disk_read(cache->disk, block, cache->entries[idx].data) == -1) {
+		ret = -1;
+		goto out;
+	}
+	cache_link(cache, idx, block);
+	memcpy(buf, cache->entries[idx].data, BLOCK_SIZE);
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Called with the cache locked */
+static int __cache_write(struct cache *cache, size_t block,
+			 const void *buf)
+{
+	int idx;
+
+	idx = cache_lookup(cache, block);
+	if (idx != NO_ENTRY) {
+		cache->stats.hits++;
+	} else {
+		cache->stats.misses++;
+		idx = cache_evict(cache);
+		if (idx == NO_ENTRY)
+			return -1;
+		cache_link(cache, idx, block);
+	}
+
+	memcpy(cache->entries[idx].data, buf, BLOCK_SIZE);
+	if (!cache->entries[idx].dirty) {
+		cache->entries[idx].dirty = 1;
+		cache->entries[idx].dirtied = cache_now();
+		cache->stats.dirty++;
+	}
+	cache->entries[idx].seq = ++cache->seq;
+	cache->entries[idx].ref = 1;
+
+	return 0;
+}
+
+int cache_write(struct cache *cache, size_t block, const void *buf)
+{
+	int ret;
+
+	if (!cache->nblocks)
+		return disk_write(cache->disk, block, buf);
+
+	pthread_mutex_lock(&cache->lock);
+	ret = __cache_write(cache, block, buf);
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+/* Keep a clean copy of a block that was just read from the disk */
+static void cache_fill(struct cache *cache, size_t block, const void *buf)
+{
+	int idx;
+
+	if (cache_lookup(cache, block) != NO_ENTRY)
+		return;
+
+	idx = cache_evict(cache);
+	if (idx == NO_ENTRY)
+		return;
+	memcpy(cache->entries[idx].data, buf, BLOCK_SIZE);
+	cache_link(cache, idx, block);
+}
+
+int cache_batch(struct cache *cache, struct block_req *reqs, size_t count)
+{
+	struct block_req *misses;
+	size_t *origin;
+	size_t nmisses = 0;
+	int ret = 0;
+
+	if (!cache->nblocks) {
+		/*
+		 * Always wait, part of the batch may be in flight on failure.
+		 * disk_wait() also reports the failures of other threads, so
+		 * look at this batch's own results instead.
+		 */
+		ret = disk_submit(cache->disk, reqs, count);
+		disk_wait(cache->disk);
+		for (size_t i = 0; i < count; i++) {
+			if (reqs[i].result != 0)
+				ret = -1;
+		}
+		return ret;
+	}
+
+	misses = malloc(count * sizeof(*misses));
+	origin = malloc(count * sizeof(*origin));
+	if (!misses || !origin) {
+		free(misses);
+		free(origin);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < count; i++) {
+		struct block_req *req = &reqs[i];
+		int idx;
+
+		if (req->write) {
+			req->result = __cache_write(cache, req->block, req->buf);
+		} else if ((idx = cache_lookup(cache, req->block)) != NO_ENTRY) {
+			cache->stats.hits++;
+			cache->entries[idx].ref = 1;
+			memcpy(req->buf, cache->entries[idx].data, BLOCK_SIZE);
+			req->result = 0;
+		} else {
+			cache->stats.misses++;
+			origin[nmisses] = i;
+			misses[nmisses++] = *req;
+			continue;
+		}
+
+		if (req->result == -1)
+			ret = -1;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	/*
+	 * Send all the misses to the disk as one batch. They land in the
+	 * caller's buffers, so other threads can use the cache meanwhile.
+	 */
+	if (nmisses) {
+		if (disk_submit(cache->disk, misses, nmisses) == -1)
+			ret = -1;
+		disk_wait(cache->disk);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < nmisses; i++) {
+		reqs[origin[i]].result = misses[i].result;
+		if (misses[i].result == 0)
+			cache_fill(cache, misses[i].block, misses[i].buf);
+		else
+			ret = -1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	free(misses);
+	free(origin);
+
+	return ret;
+}
+
+static int cache_cmp_block(const void *a, const void *b)
+{
+	size_t ba = (*(struct cache_entry *const *)a)->block;
+	size_t bb = (*(struct cache_entry *const *)b)->block;
+
+	return (ba > bb) - (ba < bb);
+}
+
+/* Called with the cache locked */
+static int __cache_flush(struct cache *cache)
+{
+	struct iovec iov[FLUSH_RUN_MAX];
+	struct cache_entry **dirty;
+	size_t ndirty = 0;
+	int ret = 0;
+
+	if (!cache->nblocks)
+		return 0;
+
+	dirty = malloc(cache->nblocks * sizeof(*dirty));
+	if (!dirty)
+		return -1;
+
+	for (size_t i = 0; i < cache->nblocks; i++) {
+		if (cache->entries[i].valid && cache->entries[i].dirty)
+			dirty[ndirty++] = &cache->entries[i];
+	}
+
+	/* Write back in block order, one vectored write per run of blocks */
+	qsort(dirty, ndirty, sizeof(*dirty), cache_cmp_block);
+	for (size_t i = 0; i < ndirty; ) {
+		size_t first = dirty[i]->block;
+		size_t n = 0;
+
+		while (i + n < ndirty && n < FLUSH_RUN_MAX &&
+		       dirty[i + n]->block == first + n) {
+			iov[n].iov_base = dirty[i + n]->data;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		}
+
+		if (disk_writev(cache->disk, first, iov, n) == -1) {
+			ret = -1;
+		} else {
+			for (size_t j = 0; j < n; j++)
+				dirty[i + j]->dirty = 0;
+			cache->stats.dirty -= n;
+			cache->stats.writebacks += n;
+		}
+		i += n;
+	}
+
+	free(dirty);
+
+	return ret;
+}
+
+int cache_flush(struct cache *cache)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache->lock);
+	/* An older copy of a block still being written must not land last */
+	while (cache->busy)
+		pthread_cond_wait(&cache->idle, &cache->lock);
+	ret = __cache_flush(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+static int cache_cmp_age(const void *a, const void *b)
+{
+	const struct wb_item *ia = a;
+	const struct wb_item *ib = b;
+
+	return (ia->dirtied > ib->dirtied) - (ia->dirtied < ib->dirtied);
+}
+
+static int cache_cmp_item(const void *a, const void *b)
+{
+	const struct wb_item *ia = a;
+	const struct wb_item *ib = b;
+
+	return (ia->block > ib->block) - (ia->block < ib->block);
+}
+
+/*
+ * Write back the run of blocks of @items starting at @i, with the cache locked
+ * on entry and on return. The blocks are copied to @buf and the cache is
+ * unlocked during the write, so its users only wait for the copy. Return the
+ * number of items consumed, setting @ret on failure.
+ */
+static size_t cache_writeback_run(struct cache *cache, struct wb_item *items,
+				  size_t i, size_t nitems, size_t max,
+				  char *buf, int *ret)
+{
+	uint64_t seq[FLUSH_RUN_MAX];
+	struct iovec iov;
+	size_t first = items[i].block;
+	size_t n = 0;
+	uint64_t start, elapsed;
+	int err;
+
+	/* Entries may have been written back or reused since they were picked */
+	while (i + n < nitems && n < max && items[i + n].block == first + n) {
+		struct cache_entry *e = items[i + n].e;
+
+		if (!e->valid || !e->dirty || e->block != first + n)
+			break;
+		memcpy(buf + n * BLOCK_SIZE, e->data, BLOCK_SIZE);
+		seq[n] = e->seq;
+		e->busy = 1;
+		n++;
+	}
+	if (!n)
+		return 1;
+
+	cache->busy += n;
+	pthread_mutex_unlock(&cache->lock);
+
+	iov.iov_base = buf;
+	iov.iov_len = n * BLOCK_SIZE;
+	start = cache_now();
+	err = disk_writev(cache->disk, first, &iov, 1);
+	elapsed = cache_now() - start;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t j = 0; j < n; j++) {
+		struct cache_entry *e = items[i + j].e;
+
+		e->busy = 0;
+		/* Blocks modified during the write are still dirty */
+		if (err != -1 && e->seq == seq[j]) {
+			e->dirty = 0;
+			cache->stats.dirty--;
+			cache->stats.writebacks++;
+		}
+	}
+	cache->busy -= n;
+	if (!cache->busy)
+		pthread_cond_broadcast(&cache->idle);
+
+	if (err == -1)
+		*ret = -1;
+	cache->stats.flushes++;
+	cache->stats.flush_ns += elapsed;
+	if (elapsed > cache->stats.flush_ns_max)
+		cache->stats.flush_ns_max = elapsed;
+
+	return n;
+}
+
+int cache_writeback(struct cache *cache, uint64_t age, size_t keep)
+{
+	struct wb_item *items;
+	size_t nitems = 0;
+	size_t max, n;
+	uint64_t now;
+	char *buf;
+	int ret = 0;
+
+	if (!cache->nblocks)
+		return 0;
+
+	buf = cache_buf_get(cache);
+	items = malloc(cache->nblocks * sizeof(*items));
+	if (!buf || !items) {
+		cache_buf_put(cache, buf);
+		free(items);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	while (cache->busy)
+		pthread_cond_wait(&cache->idle, &cache->lock);
+
+	for (size_t i = 0; i < cache->nblocks; i++) {
+		struct cache_entry *e = &cache->entries[i];
+
+		if (e->valid && e->dirty) {
+			items[nitems].e = e;
+			items[nitems].block = e->block;
+			items[nitems].dirtied = e->dirtied;
+			nitems++;
+		}
+	}
+
+	/* The blocks old enough, and then the oldest ones down to @keep */
+	qsort(items, nitems, sizeof(*items), cache_cmp_age);
+	now = cache_now();
+	n = 0;
+	while (n < nitems && now - items[n].dirtied >= age)
+		n++;
+	if (nitems > keep && nitems - keep > n)
+		n = nitems - keep;
+
+	/*
+	 * Written in block order. At most half of the entries are busy at once
+	 * so that evictions always find a victim, a cache of a single block is
+	 * written back with the cache locked instead.
+	 */
+	qsort(items, n, sizeof(*items), cache_cmp_item);
+	max = cache->nblocks / 2 < FLUSH_RUN_MAX ? cache->nblocks / 2 :
+						    FLUSH_RUN_MAX;
+	if (!max && n) {
+		uint64_t start = cache_now();
+		uint64_t elapsed;
+
+		ret = __cache_flush(cache);
+		elapsed = cache_now() - start;
+		cache->stats.flushes++;
+		cache->stats.flush_ns += elapsed;
+		if (elapsed > cache->stats.flush_ns_max)
+			cache->stats.flush_ns_max = elapsed;
+		n = 0;
+	}
+	for (size_t i = 0; i < n; )
+		i += cache_writeback_run(cache, items, i, n, max, buf, &ret);
+	pthread_mutex_unlock(&cache->lock);
+
+	free(items);
+	cache_buf_put(cache, buf);
+
+	return ret;
+}
+
+size_t cache_dirty(struct cache *cache)
+{
+	size_t dirty;
+
+	pthread_mutex_lock(&cache->lock);
+	dirty = cache->stats.dirty;
+	pthread_mutex_unlock(&cache->lock);
+
+	return dirty;
+}
+
+void *cache_buf_get(struct cache *cache)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->pool.nfree)
+		buf = cache->pool.free[--cache->pool.nfree];
+	pthread_mutex_unlock(&cache->lock);
+	if (buf)
+		return buf;
+
+	if (posix_memalign(&buf, BLOCK_SIZE, CACHE_BUF_BLOCKS * BLOCK_SIZE))
+		return NULL;
+
+	return buf;
+}
+
+void cache_buf_put(struct cache *cache, void *buf)
+{
+	if (!buf)
+		return;
+
+	/* Keep at most POOL_BUFS buffers around, release the extra ones */
+	pthread_mutex_lock(&cache->lock);
+	if (cache->pool.nfree < POOL_BUFS) {
+		cache->pool.free[cache->pool.nfree++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(buf);
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
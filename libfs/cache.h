@@ -0,0 +1,163 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+#include "disk.h"
+
+/* Block cache in front of a virtual disk handle */
+struct cache;
+
+/** Number of blocks held by a buffer of the pool */
+#define CACHE_BUF_BLOCKS 64
+
+/**
+ * struct cache_stats - Block cache counters
+ * @hits: Number of block lookups served from the cache
+ * @misses: Number of block lookups that had to go to the disk
+ * @writebacks: Number of dirty blocks written back to the disk
+ * @dirty: Number of dirty blocks waiting to be written back
+ * @flushes: Number of writes issued by cache_writeback()
+ * @flush_ns: Total time spent in those writes, in nanoseconds
+ * @flush_ns_max: Longest of those writes, in nanoseconds
+ */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t writebacks;
+	size_t dirty;
+	size_t flushes;
+	uint64_t flush_ns;
+	uint64_t flush_ns_max;
+};
+
+/**
+ * cache_init - Set up a block cache
+ * @disk: Virtual disk handle
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back cache of @nblocks blocks in front of virtual disk
+ * @disk. With @nblocks set to 0, the cache is disabled and every access goes
+ * straight to disk_read() and disk_write().
+ *
+ * Return: NULL if the cache cannot be allocated. The cache otherwise.
+ */
+struct cache *cache_init(struct disk *disk, size_t nblocks);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @cache: Block cache
+ *
+ * Write back every dirty block and release the cache.
+ *
+ * Return: -1 if writing back a dirty block fails (the cache is released
+ * anyway). 0 otherwise.
+ */
+int cache_destroy(struct cache *cache);
+
+/**
+ * cache_read - Read a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from the disk. 0 otherwise.
+ */
+int cache_read(struct cache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty in the cache: it reaches the disk when it is
+ * evicted, on cache_flush() or on cache_destroy().
+ *
+ * Return: -1 if the block cannot be written (or a dirty block could not be
+ * evicted). 0 otherwise.
+ */
+int cache_write(struct cache *cache, size_t block, const void *buf);
+
+/**
+ * cache_batch - Perform a batch of block requests through the cache
+ * @cache: Block cache
+ * @reqs: Array of requests
+ * @count: Number of requests in @reqs
+ *
+ * Reads that hit the cache and all writes (when the cache is enabled) are
+ * served from memory, while the remaining requests are submitted to the disk
+ * as a single batch with disk_submit(). Blocks read from the disk are then
+ * kept in the cache. Return once every request has completed.
+ *
+ * All the cache functions may be called by several threads at once; the cache
+ * is not locked while a batch's misses are being read from the disk.
+ *
+ * Return: -1 if any request failed (see each request's @result). 0 otherwise.
+ */
+int cache_batch(struct cache *cache, struct block_req *reqs, size_t count);
+
+/**
+ * cache_flush - Write back all dirty blocks
+ * @cache: Block cache
+ *
+ * Dirty blocks are written in block order, consecutive blocks being coalesced
+ * into a single vectored write.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+int cache_flush(struct cache *cache);
+
+/**
+ * cache_writeback - Write back old dirty blocks
+ * @cache: Block cache
+ * @age: Age in nanoseconds from which a dirty block is written back
+ * @keep: Number of dirty blocks that may be left in the cache
+ *
+ * Write back the blocks that have been dirty for at least @age nanoseconds,
+ * and then the oldest dirty blocks until at most @keep are left. The blocks are
+ * written in block order, consecutive blocks being coalesced into a single
+ * write. Unlike cache_flush(), the cache is only locked while the blocks are
+ * copied out, not during the writes: blocks modified meanwhile stay dirty.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+int cache_writeback(struct cache *cache, uint64_t age, size_t keep);
+
+/**
+ * cache_dirty - Get the number of dirty blocks
+ * @cache: Block cache
+ *
+ * Return: The number of blocks waiting to be written back.
+ */
+size_t cache_dirty(struct cache *cache);
+
+/**
+ * cache_buf_get - Get a staging buffer from the pool
+ * @cache: Block cache
+ *
+ * Return a %BLOCK_SIZE-aligned buffer of %CACHE_BUF_BLOCKS blocks, suitable for
+ * direct I/O. Buffers come from a pool of fixed size, so that staging memory
+ * does not grow with the size of the transfers; a buffer is only allocated
+ * outside of the pool when all of the pool's buffers are in use.
+ *
+ * Return: NULL if no buffer can be allocated. The buffer otherwise.
+ */
+void *cache_buf_get(struct cache *cache);
+
+/**
+ * cache_buf_put - Give a staging buffer back to the pool
+ * @cache: Block cache the buffer was obtained from
+ * @buf: Buffer obtained with cache_buf_get()
+ */
+void cache_buf_put(struct cache *cache, void *buf);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @cache: Block cache
+ * @stats: Structure to be filled with the counters
+ */
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
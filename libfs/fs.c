@@ -1,11 +1,15 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_format.h"
 
 /*Names of already made Constants and their value
 FS_FILENAME_LEN 16
@@ -20,664 +24,2859 @@ BLOCK_SIZE 4096
 //Constants 
 #define Half 2048
 #define FAT_EOC 65535
-
-// first block of the file system
-typedef struct SUPERBLOCK 
-{
-	char signature[8];
-	uint16_t virBlkAmt;
-	uint16_t rootIndex;
-	uint16_t dataIndex;
-	uint16_t dataBlkAmt;
-	uint8_t fatBlkAmt;
-	uint8_t padding[BLOCK_SIZE - 17];
-} sb;
-
-// root directory stores 128 entries
-// ENTRY
-typedef struct ROOT 
-{
-	char filename[FS_FILENAME_LEN];
-	uint32_t file_size;
-	uint16_t index_first;
-	uint8_t padding[10]; // size of entry (32) - 10
-} rd;
+// number of FAT steps past which a chain lookup builds the file's block map
+#define CHAIN_WALK_MAX 16
+// size of the root directory name index (power of two)
+#define NAME_HASH_SIZE (2 * FS_FILE_MAX_COUNT)
+#define NAME_EMPTY -1
+#define NAME_DELETED -2
+// number of metadata updates committed to the journal together
+#define FS_JOURNAL_GROUP 16
+// maximum number of blocks of a chain submitted to the disk at once
+#define FS_BATCH_BLOCKS CACHE_BUF_BLOCKS
+// number of threads serving the asynchronous requests of a file system
+#define FS_AIO_WORKERS 4
+// number of descriptors added to the descriptor table at a time
+#define FD_CHUNK 64
+// largest number of descriptors that can be open at once
+#define FD_LIMIT (1 << 30)
+// entry of the descriptor table for descriptor @i
+#define FD_ENTRY(ctx, i) ((ctx)->fdChunks[(i) / FD_CHUNK][(i) % FD_CHUNK])
+// default age, in milliseconds, from which the flusher writes a dirty block back
+#define FS_FLUSH_AGE_MS 1000
+// default percentage of the cache that can be dirty before the flusher wakes up
+#define FS_FLUSH_RATIO 25
 
 
 typedef struct FD_TABLE 
 {
 	int table_offset;
 	int loc; 
+	// last chain position reached through this descriptor, so sequential
+	// accesses do not walk the FAT from the first block again
+	int cursor_index; // logical block number, -1 when unset
+	uint16_t cursor_block; // matching data block
+	// taken exclusively by the operations that use the offset or the cursor,
+	// shared by the positional ones
+	pthread_rwlock_t lock;
+	int nextFree; // next descriptor of the free list, -1 at its end
 } fd;
 
-//Initializing variables
-sb superblock;
-//FAT can be any size so we just set to pointer for now
-uint16_t *FAT_array;
+// logical to data block map of a file, built on the first long chain walk
+// and kept while the file is open
+typedef struct CHAIN_MAP
+{
+	uint16_t *blocks;
+	int len; // number of blocks in the chain
+	int cap; // capacity of blocks
+	int built;
+} cm;
+
+// position in the data described by an array of buffers, so consecutive
+// accesses do not walk the array from its start again
+typedef struct IOV_CURSOR
+{
+	const struct iovec *iov;
+	int iovcnt;
+	int seg; // buffer holding the position
+	size_t base; // position of the first byte of that buffer
+} ic;
+
+// everything about one mounted file system
+struct fs_ctx
+{
+	//virtual disk holding the file system, and the cache in front of it
+	struct disk *disk;
+	struct cache *cache;
+
+	sb superblock;
+	//FAT can be any size so we just set to pointer for now
+	uint16_t *FAT_array;
+	//FAT_array is a private mapping of the FAT, paged in on first access
+	int fatPaged;
+	//one flag per FAT block, set when the block differs from its copy on disk
+	uint8_t *fatDirty;
+	//root directory modified since it was last written back
+	int rootDirty;
+	//hold metadata updates in memory until the next sync
+	int metaLazy;
+	//journal block being built, and the number of updates not committed yet
+	jh journalHeader;
+	int journalOps;
+	//blocks freed since the last commit, not reused until the commit is durable
+	uint16_t *pendingFree;
+	int pendingCount;
+	//first blocks of deleted files whose chains are not released yet
+	uint16_t *reclaimList;
+	int reclaimLen;
+	int reclaimCap;
+	//leave the chains of deleted files to fs_reclaim_ctx()
+	int deferFree;
+	//free data blocks, one bit per FAT entry (set when free)
+	uint64_t *freeMap;
+	//lowest word of freeMap that may still have a free block
+	int freeHint;
+	//one flag per FAT block, set once the free blocks it describes are in
+	//freeMap; when the free counter comes from the superblock, a FAT block is
+	//only indexed by the first allocation or release that reaches it
+	uint8_t *freeLoaded;
+
+	rd rootDir[FS_FILE_MAX_COUNT];
+	//descriptor table, allocated in chunks that never move so descriptors can
+	//be used while it grows
+	fd **fdChunks;
+	int fdMax; // number of descriptors the mount options allow
+	int fdCap; // number of descriptors with an entry
+	//free descriptors, kept as a lock-free stack: the descriptor at the top
+	//plus one (0 when empty) in the low half, a counter bumped by every
+	//update in the high half so a stale top cannot be mistaken for the current
+	uint64_t fdFree;
+	int fdOpen; // number of open descriptors
+	int openCount[FS_FILE_MAX_COUNT]; // open descriptors of each file
+	cm chainMap[FS_FILE_MAX_COUNT];
+	//open addressing index from file names to root directory entries
+	int16_t nameHash[NAME_HASH_SIZE];
+	int nameDeleted;
+	//free root directory entries, one bit per entry (set when free)
+	uint64_t rootFreeMap[FS_FILE_MAX_COUNT / 64];
+
+	//Locks, always taken in this order: descriptor, directory, file, block map,
+	//descriptor table, FAT
+	//guards the file names of the root directory and its free entries
+	pthread_rwlock_t dirLock;
+	//one reader/writer lock per file, indexed like the root directory
+	pthread_rwlock_t fileLock[FS_FILE_MAX_COUNT];
+	//guards the block maps of files read by several threads at once
+	pthread_mutex_t mapLock[FS_FILE_MAX_COUNT];
+	//serializes the growth of the descriptor table
+	pthread_mutex_t fdLock;
+	//guards the FAT, the free blocks, the root directory entries and writing
+	//them back
+	pthread_mutex_t fatLock;
+
+	//requests of fs_read_async() and fs_write_async() waiting for a worker,
+	//and the workers, started by the first request
+	struct fs_aio *aioHead;
+	struct fs_aio *aioTail;
+	pthread_t aioWorkers[FS_AIO_WORKERS];
+	int aioStarted; // number of workers running
+	int aioStop; // set when the workers must exit once the queue is empty
+	//guards the queue and the completion of the requests, never held while a
+	//request is performed
+	pthread_mutex_t aioLock;
+	pthread_cond_t aioQueued; // a request was queued or the workers must stop
+	pthread_cond_t aioDone; // a request without callback completed
+
+	//background write-back of the cached blocks and of the pending metadata
+	//updates, 0 in flushAge when the mount options do not ask for it
+	pthread_t flushThread;
+	int flushStarted;
+	int flushStop; // set when the flusher must exit
+	int flushKick; // set when too many blocks are dirty to wait for the timer
+	uint64_t flushAge; // nanoseconds
+	size_t flushKeep; // dirty blocks allowed before the flusher is kicked
+	uint64_t metaDirtySince; // when the metadata updates started pending, or 0
+	pthread_mutex_t flushLock;
+	pthread_cond_t flushWake;
+
+	//Checking list
+	int rootFreeCount;
+	int fatFreeCount;
+};
+
+//file system used by the functions that do not take a context
+fs_ctx *defaultCtx;
+
+
+// write the dirty FAT blocks back to disk, one vectored call per run of them
+int fs_fat_flush(fs_ctx *ctx){
+	int i = 0;
+	while(i < ctx->superblock.fatBlkAmt){
+		if(!ctx->fatDirty[i]){
+			i++;
+			continue;
+		}
 
-rd rootDir[FS_FILE_MAX_COUNT];
-fd FD_table[FS_OPEN_MAX_COUNT];
+		int start = i;
+		while(i < ctx->superblock.fatBlkAmt && ctx->fatDirty[i]){
+			i++;
+		}
 
-//Checking list
-int mounted;
-int rootFreeCount = FS_FILE_MAX_COUNT;
-int fatFreeCount;
-int fdFreeCount = FS_OPEN_MAX_COUNT;
+		struct iovec fat_vec = {
+			.iov_base = &ctx->FAT_array[start * Half],
+			.iov_len = (i - start) * BLOCK_SIZE
+		};
+		if(disk_writev(ctx->disk, 1 + start, &fat_vec, 1) == -1){
+			return -1;
+		}
+		memset(&ctx->fatDirty[start], 0, i - start);
+	}
 
+	return 0;
+}
 
-/**
- * fs_mount - Mount a file system
- * @diskname: Name of the virtual disk file
- *
- * Open the virtual disk file @diskname and mount the file system that it
- * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
- *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
- */
-int fs_mount(const char *diskname)
-{
-	if(!strlen(diskname)){
-		fprintf(stderr, "Error: Empty Disk name\n");
+// write the root directory and the dirty FAT blocks in place
+int fs_meta_write(fs_ctx *ctx){
+	if(fs_fat_flush(ctx) == -1){
 		return -1;
 	}
 
-	if(block_disk_open(diskname) == -1){
-		return -1;
+	if(ctx->rootDirty){
+		if(disk_write(ctx->disk, ctx->superblock.rootIndex, &ctx->rootDir) == -1){
+			return -1;
+		}
+		ctx->rootDirty = 0;
 	}
 
+	return 0;
+}
 
-	//read the superblock and check if its correct
-	if(block_read(0, &superblock) == -1){
+// FNV-1a hash of @len bytes, continuing from @hash
+uint32_t fs_journal_sum(uint32_t hash, const void *buf, size_t len){
+	const uint8_t *bytes = (const uint8_t*)buf;
+
+	for(size_t i = 0; i < len; i++){
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// log the dirty root directory and FAT blocks to the journal as one group,
+// then write them in place
+int fs_journal_commit(fs_ctx *ctx){
+	struct iovec vec[JOURNAL_MAX_BLOCKS];
+	int count = 0;
+
+	ctx->journalOps = 0;
+
+	if(ctx->rootDirty){
+		ctx->journalHeader.targets[count] = ctx->superblock.rootIndex;
+		vec[count].iov_base = ctx->rootDir;
+		vec[count].iov_len = BLOCK_SIZE;
+		count++;
+	}
+	for(int i = 0; i < ctx->superblock.fatBlkAmt; i++){
+		if(ctx->fatDirty[i]){
+			ctx->journalHeader.targets[count] = 1 + i;
+			vec[count].iov_base = &ctx->FAT_array[i * Half];
+			vec[count].iov_len = BLOCK_SIZE;
+			count++;
+		}
+	}
+
+	if(count == 0){
+		return 0;
+	}
+
+	uint32_t sum = JOURNAL_SUM_SEED;
+	for(int i = 0; i < count; i++){
+		sum = fs_journal_sum(sum, vec[i].iov_base, BLOCK_SIZE);
+	}
+
+	// the data blocks the new metadata points to go to disk first
+	if(cache_flush(ctx->cache) == -1){
 		return -1;
 	}
 
-	if(memcmp(superblock.signature, "ECS150FS", 8) != 0){
+	if(disk_writev(ctx->disk, ctx->superblock.journalIndex + 1, vec, count) == -1){
 		return -1;
 	}
 
-	if(superblock.virBlkAmt != block_disk_count()){
+	memcpy(ctx->journalHeader.signature, JOURNAL_SIGNATURE, 8);
+	ctx->journalHeader.sequence++;
+	ctx->journalHeader.checksum = sum;
+	ctx->journalHeader.count = count;
+	if(disk_write(ctx->disk, ctx->superblock.journalIndex, &ctx->journalHeader) == -1 || disk_sync(ctx->disk) == -1){
 		return -1;
 	}
 
+	// the group is durable, update the metadata in place and retire it
+	if(fs_meta_write(ctx) == -1 || disk_sync(ctx->disk) == -1){
+		return -1;
+	}
 
-	// initialize root directory by reading it
-	if(block_read(superblock.rootIndex, &rootDir) == -1){
+	ctx->journalHeader.count = 0;
+	if(disk_write(ctx->disk, ctx->superblock.journalIndex, &ctx->journalHeader) == -1){
 		return -1;
 	}
 
-	for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(rootDir[i].filename[0] != '\0'){
-			rootFreeCount--;
+	for(int i = 0; i < ctx->pendingCount; i++){
+		uint16_t loc = ctx->pendingFree[i];
+		ctx->freeMap[loc / 64] |= (uint64_t)1 << (loc % 64);
+		if(loc / 64 < ctx->freeHint){
+			ctx->freeHint = loc / 64;
 		}
 	}
-	
+	ctx->pendingCount = 0;
 
+	return 0;
+}
 
-	FAT_array = (uint16_t*)malloc(sizeof(uint16_t) * superblock.dataBlkAmt);
-	fatFreeCount = superblock.dataBlkAmt;
-	uint16_t buf[Half];
-	int offset = 0;
-	// read to the FAT
-	for (int i = 1; i <= superblock.fatBlkAmt; i++) {
-		if(block_read(i, &buf) == -1){
-			return -1;
-		}
+// put the metadata blocks of a group that was committed but possibly not
+// written in place before a crash where they belong
+int fs_journal_replay(fs_ctx *ctx){
+	if(disk_read(ctx->disk, ctx->superblock.journalIndex, &ctx->journalHeader) == -1){
+		return -1;
+	}
 
-		for(int j = 0; j < Half; j++){
-			if(offset == superblock.dataBlkAmt){
-				break;
-			}
+	if(memcmp(ctx->journalHeader.signature, JOURNAL_SIGNATURE, 8) != 0){
+		memset(&ctx->journalHeader, 0, sizeof(jh));
+		return 0;
+	}
 
-			FAT_array[offset] = buf[j];
-			if(FAT_array[offset] != 0){
-				fatFreeCount--;
-			}
+	int count = ctx->journalHeader.count;
+	if(count == 0){
+		return 0;
+	}
+	if(count > ctx->superblock.journalBlkAmt - 1){
+		return -1;
+	}
 
-			offset++;
-		}
+	void *logged = malloc(count * BLOCK_SIZE);
+	if(logged == NULL){
+		return -1;
+	}
 
-		if(offset == superblock.dataBlkAmt){
-			break;
+	struct iovec log_vec = {
+		.iov_base = logged,
+		.iov_len = count * BLOCK_SIZE
+	};
+	if(disk_readv(ctx->disk, ctx->superblock.journalIndex + 1, &log_vec, 1) == -1){
+		free(logged);
+		return -1;
+	}
+
+	// a torn group was never committed, the old metadata is still in place
+	uint32_t sum = fs_journal_sum(JOURNAL_SUM_SEED, logged, count * BLOCK_SIZE);
+	if(sum == ctx->journalHeader.checksum){
+		for(int i = 0; i < count; i++){
+			uint16_t target = ctx->journalHeader.targets[i];
+			if(target != ctx->superblock.rootIndex && (target < 1 || target > ctx->superblock.fatBlkAmt)){
+				free(logged);
+				return -1;
+			}
+			if(disk_write(ctx->disk, target, (uint8_t*)logged + i * BLOCK_SIZE) == -1){
+				free(logged);
+				return -1;
+			}
+		}
+		if(disk_sync(ctx->disk) == -1){
+			free(logged);
+			return -1;
 		}
 	}
+	free(logged);
 
-	
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		FD_table[i].table_offset = -1;
-		FD_table[i].loc = -1;
+	ctx->journalHeader.count = 0;
+	return disk_write(ctx->disk, ctx->superblock.journalIndex, &ctx->journalHeader);
+}
+
+// index the free blocks described by FAT block @blk so allocation does not
+// have to scan the FAT, unless that was already done; return how many were
+// found
+int fs_free_map_load(fs_ctx *ctx, int blk){
+	if(ctx->freeLoaded[blk]){
+		return 0;
 	}
 
-	mounted = 1;
-	return 0;
+	int count = 0;
+	int end = (blk + 1) * Half;
+	if(end > ctx->superblock.dataBlkAmt){
+		end = ctx->superblock.dataBlkAmt;
+	}
+	for(int i = blk * Half; i < end; i++){
+		if(ctx->FAT_array[i] == 0){
+			ctx->freeMap[i / 64] |= (uint64_t)1 << (i % 64);
+			count++;
+		}
+	}
+	ctx->freeLoaded[blk] = 1;
+
+	return count;
 }
 
+// word @word of the free block index, indexing its FAT block first if needed
+uint64_t fs_free_word(fs_ctx *ctx, int word){
+	fs_free_map_load(ctx, word * 64 / Half);
+	return ctx->freeMap[word];
+}
 
-/**
- * fs_umount - Unmount file system
- *
- * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
- *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
- */
-int fs_umount(void)
-{
-	if(!mounted || block_disk_close() == -1){
+// release the blocks that neither a file nor the journal reaches, which is what
+// is left of the files deleted with FS_MOUNT_DEFER_FREE and not reclaimed
+// before the process died; return how many were released
+int fs_fat_sweep(fs_ctx *ctx){
+	int count = ctx->superblock.dataBlkAmt;
+	uint64_t *used = (uint64_t*)calloc((count + 63) / 64, sizeof(uint64_t));
+	if(used == NULL){
 		return -1;
 	}
 
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(FD_table[i].loc != -1){
-			return -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if(ctx->rootDir[i].filename[0] == '\0'){
+			continue;
+		}
+		// stop at a block already seen so a corrupted chain cannot loop
+		uint16_t curr = ctx->rootDir[i].index_first;
+		while(curr < count && !(used[curr / 64] & ((uint64_t)1 << (curr % 64)))){
+			used[curr / 64] |= (uint64_t)1 << (curr % 64);
+			curr = ctx->FAT_array[curr];
+		}
+	}
+	if(ctx->superblock.journalBlkAmt != 0){
+		int start = ctx->superblock.journalIndex - ctx->superblock.dataIndex;
+		for(int i = start; i < start + ctx->superblock.journalBlkAmt && i < count; i++){
+			used[i / 64] |= (uint64_t)1 << (i % 64);
 		}
 	}
-	
 
-	free(FAT_array);
-	fatFreeCount = 0;
+	// entry 0 is reserved
+	int released = 0;
+	for(int i = 1; i < count; i++){
+		if(ctx->FAT_array[i] != 0 && !(used[i / 64] & ((uint64_t)1 << (i % 64)))){
+			ctx->FAT_array[i] = 0;
+			ctx->fatDirty[i / Half] = 1;
+			released++;
+		}
+	}
+	free(used);
 
-	
-	memset(&rootDir, 0, sizeof(rd));
+	return released;
+}
+
+// clear the clean flag on disk before the metadata changes, so the free
+// counters saved with it are not trusted if the file system is not unmounted
+// cleanly again
+int fs_sb_unclean(fs_ctx *ctx){
+	if(!ctx->superblock.clean){
+		return 0;
+	}
 
-	memset(&superblock, 0, sizeof(sb));
+	ctx->superblock.clean = 0;
+	return disk_write(ctx->disk, 0, &ctx->superblock);
+}
 
-	mounted = 0;
+// save the free counters in the superblock along with the clean flag, unless
+// it already holds them
+int fs_sb_clean(fs_ctx *ctx){
+	uint32_t sum = fs_journal_sum(JOURNAL_SUM_SEED, ctx->rootDir, BLOCK_SIZE);
+	if(ctx->superblock.clean && ctx->superblock.fatFree == ctx->fatFreeCount
+	&& ctx->superblock.rootFree == ctx->rootFreeCount && ctx->superblock.rootSum == sum){
+		return 0;
+	}
 
-	return 0;
+	ctx->superblock.fatFree = ctx->fatFreeCount;
+	ctx->superblock.rootFree = ctx->rootFreeCount;
+	ctx->superblock.rootSum = sum;
+	ctx->superblock.clean = 1;
+	return disk_write(ctx->disk, 0, &ctx->superblock);
 }
 
+// reserve the journal in the last free run of data blocks large enough for
+// the root directory and the whole FAT; the blocks are chained in the FAT so
+// other tools see them as used
+int fs_journal_create(fs_ctx *ctx){
+	int len = 2 + ctx->superblock.fatBlkAmt;
+	int start = -1;
+	int run = 0;
 
-/**
- * fs_info - Display information about file system
- *
- * Display some information about the currently mounted file system.
- *
- * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
- */
-int fs_info(void)
-{
-	if(!mounted){
+	for(int i = 0; i < ctx->superblock.fatBlkAmt; i++){
+		fs_free_map_load(ctx, i);
+	}
+	if(fs_sb_unclean(ctx) == -1){
 		return -1;
 	}
 
-	printf("FS Info:\n");
-    printf("total_blk_count=%d\n",superblock.virBlkAmt);
-    printf("fat_blk_count=%d\n",superblock.fatBlkAmt);
-    printf("rdir_blk=%d\n",superblock.rootIndex);
-    printf("data_blk=%d\n",superblock.dataIndex);
-    printf("data_blk_count=%d\n",superblock.dataBlkAmt);
-    printf("fat_free_ratio=%d/%d\n", fatFreeCount, superblock.dataBlkAmt);
-    printf("rdir_free_ratio=%d/%d\n", rootFreeCount, FS_FILE_MAX_COUNT);
+	for(int i = ctx->superblock.dataBlkAmt - 1; i >= 0 && start == -1; i--){
+		run = (ctx->FAT_array[i] == 0) ? run + 1 : 0;
+		if(run == len){
+			start = i;
+		}
+	}
+	if(start == -1){
+		return -1;
+	}
 
-    return 0;
-}
+	for(int i = start; i < start + len; i++){
+		ctx->FAT_array[i] = (i == start + len - 1) ? FAT_EOC : i + 1;
+		ctx->freeMap[i / 64] &= ~((uint64_t)1 << (i % 64));
+		ctx->fatDirty[i / Half] = 1;
+	}
+	ctx->fatFreeCount -= len;
 
+	ctx->superblock.journalIndex = ctx->superblock.dataIndex + start;
+	memset(&ctx->journalHeader, 0, sizeof(jh));
+	if(fs_meta_write(ctx) == -1 || disk_write(ctx->disk, ctx->superblock.journalIndex, &ctx->journalHeader) == -1
+	|| disk_sync(ctx->disk) == -1){
+		return -1;
+	}
 
-/**
- * fs_create - Create a new file
- * @filename: File name
- *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
- */
-int fs_create(const char *filename)
-{
-	if(!mounted || filename[0] == '\0' || strlen(filename) > FS_FILENAME_LEN 
-	|| rootFreeCount == 0){
+	// the journal only counts once the superblock points to it
+	ctx->superblock.journalBlkAmt = len;
+	if(disk_write(ctx->disk, 0, &ctx->superblock) == -1){
+		ctx->superblock.journalBlkAmt = 0;
 		return -1;
 	}
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp(rootDir[i].filename, filename) == 0){
-			return -1;
-		}
+
+	return disk_sync(ctx->disk);
+}
+
+// write the root directory and the dirty FAT blocks back to disk, through the
+// journal when the disk has one
+int fs_meta_flush(fs_ctx *ctx){
+	if(fs_sb_unclean(ctx) == -1){
+		return -1;
+	}
+
+	int ret;
+	if(ctx->superblock.journalBlkAmt != 0){
+		ret = fs_journal_commit(ctx);
+	}else{
+		ret = fs_meta_write(ctx);
 	}
 
+	if(ret == 0){
+		ctx->metaDirtySince = 0;
+	}
+	return ret;
+}
 
-	for(int j = 0; j < FS_FILE_MAX_COUNT; j++){
-		if(rootDir[j].filename[0] == '\0'){
-			strcpy(rootDir[j].filename, filename);
+// monotonic time in nanoseconds
+uint64_t fs_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-			rootDir[j].file_size = 0;
-			rootDir[j].index_first = FAT_EOC;
+// note a change to the root directory or the FAT, writing it through unless
+// metadata is written back lazily or the journal can take more updates first
+int fs_meta_update(fs_ctx *ctx){
+	ctx->rootDirty = 1;
 
-			if(block_write(superblock.rootIndex, &rootDir) == -1){
-				return -1;
-			}
-			rootFreeCount--;
-			return 0;
-		}
+	// the flusher writes back the updates left pending for too long
+	if(ctx->flushAge != 0 && ctx->metaDirtySince == 0){
+		ctx->metaDirtySince = fs_now();
 	}
 
-	
-	return -1;
+	if(ctx->metaLazy){
+		return 0;
+	}
+	if(ctx->superblock.journalBlkAmt != 0 && ++ctx->journalOps < FS_JOURNAL_GROUP){
+		return 0;
+	}
 
+	return fs_meta_flush(ctx);
 }
 
-void fs_fat_delete(uint16_t loc){
-	if (FAT_array[loc] == 0) {
-        return;
-    }
+// release up to @max blocks of the chain starting at @loc, marking them free
+// a bitmap word at a time; return where the rest of the chain starts, or
+// FAT_EOC once all of it is free
+uint16_t fs_fat_release(fs_ctx *ctx, uint16_t loc, int max){
+	int freed = 0;
+	int word = -1;
+	uint64_t bits = 0;
+
+	while(loc < ctx->superblock.dataBlkAmt && ctx->FAT_array[loc] != 0 && freed < max){
+		fs_free_map_load(ctx, loc / Half);
+		uint16_t next = ctx->FAT_array[loc];
+		ctx->FAT_array[loc] = 0;
+		ctx->fatDirty[loc / Half] = 1;
+		freed++;
+
+		if(ctx->superblock.journalBlkAmt != 0){
+			ctx->pendingFree[ctx->pendingCount++] = loc;
+		} else {
+			// consecutive blocks of a chain mostly share a bitmap word
+			if(loc / 64 != word){
+				if(word != -1){
+					ctx->freeMap[word] |= bits;
+				}
+				word = loc / 64;
+				bits = 0;
+				if(word < ctx->freeHint){
+					ctx->freeHint = word;
+				}
+			}
+			bits |= (uint64_t)1 << (loc % 64);
+		}
+		loc = next;
+	}
+
+	if(word != -1){
+		ctx->freeMap[word] |= bits;
+	}
+	ctx->fatFreeCount += freed;
 
-	if(FAT_array[loc] == FAT_EOC){
-		FAT_array[loc] = 0;
-		fatFreeCount++;
-		return;
-	} else{
-		uint16_t next_loc = FAT_array[loc];
-		FAT_array[loc] = 0;
-		fatFreeCount++;
-		fs_fat_delete(next_loc);
+	if(loc < ctx->superblock.dataBlkAmt && ctx->FAT_array[loc] != 0){
+		return loc;
 	}
+	return FAT_EOC;
 }
-/**
- * fs_delete - Delete a file
- * @filename: File name
- *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
- */
-int fs_delete(const char *filename) {
-	if(!mounted || filename[0] == '\0' || strlen(filename) > FS_FILENAME_LEN){
-		return -1;
+
+// release up to @max blocks (all of them when 0) of the chains left behind by
+// deleted files, return how many were released
+int fs_reclaim_blocks(fs_ctx *ctx, int max){
+	int freed = 0;
+
+	if(max == 0){
+		max = ctx->superblock.dataBlkAmt;
 	}
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(FD_table[i].loc != -1){
-			return -1;
+
+	while(ctx->reclaimLen > 0 && freed < max){
+		uint16_t head = ctx->reclaimList[ctx->reclaimLen - 1];
+		int before = ctx->fatFreeCount;
+		uint16_t rest = fs_fat_release(ctx, head, max - freed);
+		freed += ctx->fatFreeCount - before;
+
+		if(rest == FAT_EOC){
+			ctx->reclaimLen--;
+		} else {
+			ctx->reclaimList[ctx->reclaimLen - 1] = rest;
 		}
 	}
 
+	return freed;
+}
 
-	// iterate through files
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp(rootDir[i].filename, filename) == 0){
-			fs_fat_delete(rootDir[i].index_first);
-			rootDir[i].filename[0] = '\0';
-			rootDir[i].file_size = 0;
-			rootDir[i].index_first = 0;
-			rootFreeCount++;
-			
-			// write changes to FAT onto disk
-			for(int i = 1; i <= superblock.fatBlkAmt; i++){
-				block_write(i, &FAT_array[(i - 1) * Half]);
-			}
+// FNV-1a hash of a file name
+uint32_t fs_name_hash(const char *filename){
+	uint32_t hash = 2166136261u;
 
-			// write changes to the root onto disk
-			if(block_write(superblock.rootIndex, &rootDir) == -1){
-				return -1;
-			}
+	for(int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++){
+		hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+	}
 
-			return 0;
+	return hash;
+}
+
+// root directory entry of file @filename, -1 if there is none
+int fs_name_find(fs_ctx *ctx, const char *filename){
+	uint32_t slot = fs_name_hash(filename) & (NAME_HASH_SIZE - 1);
+
+	for(int i = 0; i < NAME_HASH_SIZE; i++){
+		int root = ctx->nameHash[slot];
+		if(root == NAME_EMPTY){
+			return -1;
+		}
+		if(root != NAME_DELETED && strncmp(ctx->rootDir[root].filename, filename, FS_FILENAME_LEN) == 0){
+			return root;
 		}
+		slot = (slot + 1) & (NAME_HASH_SIZE - 1);
 	}
 
 	return -1;
 }
 
+// index root directory entry @root under its file name
+void fs_name_insert(fs_ctx *ctx, int root){
+	uint32_t slot = fs_name_hash(ctx->rootDir[root].filename) & (NAME_HASH_SIZE - 1);
 
-/**
- * fs_ls - List files on file system
- *
- * List information about the files located in the root directory.
- *
- * Return: -1 if no FS is currently mounted. 0 otherwise.
- */
-int fs_ls(void)
-{
-	if(!mounted){
-		return -1;
+	while(ctx->nameHash[slot] >= 0){
+		slot = (slot + 1) & (NAME_HASH_SIZE - 1);
 	}
-	
-	printf("FS Ls:\n");
-	for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(rootDir[i].filename[0] != '\0'){
-			printf("file: %s, size: %d, data_blk: %d\n", 
-			rootDir[i].filename, rootDir[i].file_size, rootDir[i].index_first);
-		}
+	if(ctx->nameHash[slot] == NAME_DELETED){
+		ctx->nameDeleted--;
 	}
-	return 0;
+	ctx->nameHash[slot] = root;
+	ctx->rootFreeMap[root / 64] &= ~((uint64_t)1 << (root % 64));
+	ctx->rootFreeCount--;
 }
 
+// rebuild the name index and the free entry map from the root directory
+void fs_name_rebuild(fs_ctx *ctx){
+	for(int i = 0; i < NAME_HASH_SIZE; i++){
+		ctx->nameHash[i] = NAME_EMPTY;
+	}
+	ctx->nameDeleted = 0;
+	memset(ctx->rootFreeMap, 0xff, sizeof(ctx->rootFreeMap));
+	ctx->rootFreeCount = FS_FILE_MAX_COUNT;
 
-/**
- * fs_open - Open a file
- * @filename: File name
- *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
- */
-int fs_open(const char *filename)
-{
-	if(!mounted || filename[0] == '\0' || strlen(filename) > FS_FILENAME_LEN 
-	|| fdFreeCount < 1 ){
-		return -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if(ctx->rootDir[i].filename[0] != '\0'){
+			fs_name_insert(ctx, i);
+		}
 	}
+}
 
+// drop root directory entry @root from the name index
+void fs_name_remove(fs_ctx *ctx, int root){
+	uint32_t slot = fs_name_hash(ctx->rootDir[root].filename) & (NAME_HASH_SIZE - 1);
 
-	int location = 0;
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(strcmp(rootDir[i].filename, filename) == 0){
-			for(int j = 0; j < FS_OPEN_MAX_COUNT; j++){
-				if(FD_table[j].loc == -1){
-					FD_table[j].table_offset = 0;
-					FD_table[j].loc = location;
-					location = j;
-					break;
-				}
-			}
-			fdFreeCount--;
-			return location;
+	while(ctx->nameHash[slot] != root){
+		slot = (slot + 1) & (NAME_HASH_SIZE - 1);
+	}
+	ctx->nameHash[slot] = NAME_DELETED;
+	ctx->rootFreeMap[root / 64] |= (uint64_t)1 << (root % 64);
+	ctx->rootFreeCount++;
+	ctx->nameDeleted++;
+}
+
+// lowest free root directory entry, -1 if the root directory is full
+int fs_root_alloc(fs_ctx *ctx){
+	for(int i = 0; i < FS_FILE_MAX_COUNT / 64; i++){
+		if(ctx->rootFreeMap[i] != 0){
+			return i * 64 + __builtin_ctzll(ctx->rootFreeMap[i]);
 		}
 	}
-	
+
 	return -1;
+}
 
+
+// push descriptors @first to @last, already chained through their nextFree
+// fields, onto the free list
+void fs_fd_release(fs_ctx *ctx, int first, int last){
+	uint64_t head = __atomic_load_n(&ctx->fdFree, __ATOMIC_RELAXED);
+	uint64_t top;
+
+	do {
+		__atomic_store_n(&FD_ENTRY(ctx, last).nextFree, (int)(uint32_t)head - 1, __ATOMIC_RELAXED);
+		top = (((head >> 32) + 1) << 32) | (uint32_t)(first + 1);
+	} while(!__atomic_compare_exchange_n(&ctx->fdFree, &head, top, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
+// add a chunk of descriptors to the table, unless another thread just did;
+// -1 if the table already holds every descriptor allowed
+int fs_fd_grow(fs_ctx *ctx){
+	pthread_mutex_lock(&ctx->fdLock);
+	if((uint32_t)__atomic_load_n(&ctx->fdFree, __ATOMIC_ACQUIRE) != 0){
+		pthread_mutex_unlock(&ctx->fdLock);
+		return 0;
+	}
 
-/**
- * fs_close - Close a file
- * @fd: File descriptor
- *
- * Close file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
- */
-int fs_close(int fd)
-{
-	if(!mounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || FD_table[fd].loc == -1){
+	int first = ctx->fdCap;
+	int n = (ctx->fdMax - first < FD_CHUNK) ? ctx->fdMax - first : FD_CHUNK;
+	fd *chunk = NULL;
+	if(n > 0){
+		chunk = (fd*)calloc(FD_CHUNK, sizeof(fd));
+	}
+	if(chunk == NULL){
+		pthread_mutex_unlock(&ctx->fdLock);
 		return -1;
 	}
 
-	FD_table[fd].loc = -1;
-	FD_table[fd].table_offset = -1;
+	for(int i = 0; i < FD_CHUNK; i++){
+		chunk[i].table_offset = -1;
+		chunk[i].loc = -1;
+		chunk[i].cursor_index = -1;
+		chunk[i].nextFree = first + i + 1;
+		pthread_rwlock_init(&chunk[i].lock, NULL);
+	}
 
-	fdFreeCount++;
+	// the chunk is complete before any thread can reach its descriptors
+	__atomic_store_n(&ctx->fdChunks[first / FD_CHUNK], chunk, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctx->fdCap, first + n, __ATOMIC_RELEASE);
+	fs_fd_release(ctx, first, first + n - 1);
+	pthread_mutex_unlock(&ctx->fdLock);
 
 	return 0;
 }
 
+// take a descriptor off the free list, growing the table when it is empty; -1
+// if all the descriptors allowed are open
+int fs_fd_alloc(fs_ctx *ctx){
+	uint64_t head = __atomic_load_n(&ctx->fdFree, __ATOMIC_ACQUIRE);
 
-/**
- * fs_stat - Get file status
+	for(;;){
+		int j = (int)(uint32_t)head - 1;
+		if(j == -1){
+			if(fs_fd_grow(ctx) == -1){
+				return -1;
+			}
+			head = __atomic_load_n(&ctx->fdFree, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		int next = __atomic_load_n(&FD_ENTRY(ctx, j).nextFree, __ATOMIC_RELAXED);
+		uint64_t top = (((head >> 32) + 1) << 32) | (uint32_t)(next + 1);
+		if(__atomic_compare_exchange_n(&ctx->fdFree, &head, top, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+			__atomic_add_fetch(&ctx->fdOpen, 1, __ATOMIC_RELAXED);
+			return j;
+		}
+	}
+}
+
+// lock descriptor @fd, exclusively unless @shared is set, and return the root
+// directory entry of its file, -1 if the descriptor is invalid
+int fs_fd_lock(fs_ctx *ctx, int fd, int shared){
+	if(ctx == NULL || fd < 0 || fd >= __atomic_load_n(&ctx->fdCap, __ATOMIC_ACQUIRE)){
+		return -1;
+	}
+
+	if(shared){
+		pthread_rwlock_rdlock(&FD_ENTRY(ctx, fd).lock);
+	} else {
+		pthread_rwlock_wrlock(&FD_ENTRY(ctx, fd).lock);
+	}
+	if(FD_ENTRY(ctx, fd).loc == -1){
+		pthread_rwlock_unlock(&FD_ENTRY(ctx, fd).lock);
+		return -1;
+	}
+
+	return FD_ENTRY(ctx, fd).loc;
+}
+
+// lock descriptor @fd for an operation on its offset or cursor
+int fs_fd_get(fs_ctx *ctx, int fd){
+	return fs_fd_lock(ctx, fd, 0);
+}
+
+// unlock descriptor @fd after fs_fd_get() or fs_fd_lock()
+void fs_fd_put(fs_ctx *ctx, int fd){
+	pthread_rwlock_unlock(&FD_ENTRY(ctx, fd).lock);
+}
+
+
+// perform the queued asynchronous requests of file system @arg until told to
+// stop
+void *fs_aio_worker(void *arg){
+	fs_ctx *ctx = (fs_ctx*)arg;
+
+	pthread_mutex_lock(&ctx->aioLock);
+	for(;;){
+		while(ctx->aioHead == NULL && !ctx->aioStop){
+			pthread_cond_wait(&ctx->aioQueued, &ctx->aioLock);
+		}
+		struct fs_aio *aio = ctx->aioHead;
+		if(aio == NULL){
+			break;
+		}
+		ctx->aioHead = aio->next;
+		if(ctx->aioHead == NULL){
+			ctx->aioTail = NULL;
+		}
+		pthread_mutex_unlock(&ctx->aioLock);
+
+		if(aio->write){
+			aio->result = fs_pwrite_ctx(ctx, aio->fd, aio->buf, aio->count, aio->offset);
+		} else {
+			aio->result = fs_pread_ctx(ctx, aio->fd, aio->buf, aio->count, aio->offset);
+		}
+
+		// the request belongs to its callback from now on
+		if(aio->callback != NULL){
+			aio->callback(aio);
+			pthread_mutex_lock(&ctx->aioLock);
+			continue;
+		}
+
+		pthread_mutex_lock(&ctx->aioLock);
+		aio->done = 1;
+		pthread_cond_broadcast(&ctx->aioDone);
+	}
+	pthread_mutex_unlock(&ctx->aioLock);
+
+	return NULL;
+}
+
+// let the workers of file system @ctx finish the queued requests, then stop
+// them; the next request starts them again
+void fs_aio_stop(fs_ctx *ctx){
+	pthread_mutex_lock(&ctx->aioLock);
+	int started = ctx->aioStarted;
+	ctx->aioStop = 1;
+	pthread_cond_broadcast(&ctx->aioQueued);
+	pthread_mutex_unlock(&ctx->aioLock);
+
+	for(int i = 0; i < started; i++){
+		pthread_join(ctx->aioWorkers[i], NULL);
+	}
+
+	pthread_mutex_lock(&ctx->aioLock);
+	ctx->aioStarted = 0;
+	ctx->aioStop = 0;
+	pthread_mutex_unlock(&ctx->aioLock);
+}
+
+// background write-back: wake up every half of the flush age, or as soon as too
+// many blocks are dirty, and write back the data blocks and then the metadata
+// updates that have been pending for long enough
+void *fs_flusher(void *arg){
+	fs_ctx *ctx = (fs_ctx*)arg;
+
+	pthread_mutex_lock(&ctx->flushLock);
+	while(!ctx->flushStop){
+		if(!ctx->flushKick){
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t wake = (uint64_t)ts.tv_nsec + ctx->flushAge / 2;
+			ts.tv_sec += wake / 1000000000;
+			ts.tv_nsec = wake % 1000000000;
+			pthread_cond_timedwait(&ctx->flushWake, &ctx->flushLock, &ts);
+			if(ctx->flushStop){
+				break;
+			}
+		}
+		// once kicked, go down to half the limit so writers do not kick
+		// again right away
+		size_t keep = ctx->flushKick ? ctx->flushKeep / 2 : ctx->flushKeep;
+		ctx->flushKick = 0;
+		pthread_mutex_unlock(&ctx->flushLock);
+
+		// failures are reported again by the next sync or unmount
+		cache_writeback(ctx->cache, ctx->flushAge, keep);
+
+		pthread_mutex_lock(&ctx->fatLock);
+		if(ctx->metaDirtySince != 0 && fs_now() - ctx->metaDirtySince >= ctx->flushAge){
+			fs_meta_flush(ctx);
+		}
+		pthread_mutex_unlock(&ctx->fatLock);
+
+		pthread_mutex_lock(&ctx->flushLock);
+	}
+	pthread_mutex_unlock(&ctx->flushLock);
+
+	return NULL;
+}
+
+// start the flusher if the mount options asked for it
+int fs_flush_start(fs_ctx *ctx){
+	if(ctx->flushAge == 0){
+		return 0;
+	}
+
+	ctx->flushStop = 0;
+	if(pthread_create(&ctx->flushThread, NULL, fs_flusher, ctx) != 0){
+		return -1;
+	}
+	ctx->flushStarted = 1;
+
+	return 0;
+}
+
+// stop the flusher, waiting for the write-back in progress
+void fs_flush_stop(fs_ctx *ctx){
+	if(!ctx->flushStarted){
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->flushLock);
+	ctx->flushStop = 1;
+	pthread_cond_signal(&ctx->flushWake);
+	pthread_mutex_unlock(&ctx->flushLock);
+
+	pthread_join(ctx->flushThread, NULL);
+	ctx->flushStarted = 0;
+}
+
+// wake the flusher up early once too many cached blocks are dirty
+void fs_flush_kick(fs_ctx *ctx){
+	if(ctx->flushAge == 0 || cache_dirty(ctx->cache) <= ctx->flushKeep){
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->flushLock);
+	ctx->flushKick = 1;
+	pthread_cond_signal(&ctx->flushWake);
+	pthread_mutex_unlock(&ctx->flushLock);
+}
+
+// release everything held by context @ctx, which is not mounted or is being
+// unmounted
+void fs_ctx_free(fs_ctx *ctx){
+	fs_flush_stop(ctx);
+
+	if(ctx->cache != NULL){
+		cache_destroy(ctx->cache);
+	}
+	if(ctx->fatPaged && ctx->FAT_array != NULL){
+		disk_unmap_private(ctx->disk, ctx->FAT_array, 1, ctx->superblock.fatBlkAmt);
+	}else{
+		free(ctx->FAT_array);
+	}
+	if(ctx->disk != NULL){
+		disk_close(ctx->disk);
+	}
+
+	for(int i = 0; i < ctx->fdCap; i += FD_CHUNK){
+		for(int j = 0; j < FD_CHUNK; j++){
+			pthread_rwlock_destroy(&FD_ENTRY(ctx, i + j).lock);
+		}
+		free(ctx->fdChunks[i / FD_CHUNK]);
+	}
+	free(ctx->fdChunks);
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		pthread_rwlock_destroy(&ctx->fileLock[i]);
+		pthread_mutex_destroy(&ctx->mapLock[i]);
+		free(ctx->chainMap[i].blocks);
+	}
+	pthread_rwlock_destroy(&ctx->dirLock);
+	pthread_mutex_destroy(&ctx->fdLock);
+	pthread_mutex_destroy(&ctx->fatLock);
+	pthread_mutex_destroy(&ctx->aioLock);
+	pthread_cond_destroy(&ctx->aioQueued);
+	pthread_cond_destroy(&ctx->aioDone);
+	pthread_mutex_destroy(&ctx->flushLock);
+	pthread_cond_destroy(&ctx->flushWake);
+
+	free(ctx->fatDirty);
+	free(ctx->freeMap);
+	free(ctx->freeLoaded);
+	free(ctx->pendingFree);
+	free(ctx->reclaimList);
+	free(ctx);
+}
+
+
+/**
+ * fs_mount_ctx - Mount a file system and return its context
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Open the virtual disk file @diskname and mount the file system that it
+ * contains. A file system needs to be mounted before files can be read from it
+ * with fs_read_ctx() or written to it with fs_write_ctx().
+ *
+ * Once mounted, the file system can be used by several threads at once:
+ * accesses to different files proceed in parallel, and reads of the same file
+ * only wait for its writers. Mounting and unmounting must not run concurrently
+ * with any other call on the same context.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The context of the file system otherwise.
+ */
+fs_ctx *fs_mount_ctx(const char *diskname, const struct fs_options *opts)
+{
+	int disk_flags = 0;
+
+	if(!strlen(diskname)){
+		fprintf(stderr, "Error: Empty Disk name\n");
+		return NULL;
+	}
+
+	if(opts != NULL && (opts->flags & FS_MOUNT_MMAP)){
+		disk_flags |= BLOCK_DISK_MMAP;
+	}
+	if(opts != NULL && (opts->flags & FS_MOUNT_URING)){
+		disk_flags |= BLOCK_DISK_URING;
+	}
+	if(opts != NULL && (opts->flags & FS_MOUNT_DIRECT)){
+		disk_flags |= BLOCK_DISK_DIRECT;
+	}
+
+	fs_ctx *ctx = (fs_ctx*)calloc(1, sizeof(fs_ctx));
+	if(ctx == NULL){
+		return NULL;
+	}
+
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		pthread_rwlock_init(&ctx->fileLock[i], NULL);
+		pthread_mutex_init(&ctx->mapLock[i], NULL);
+	}
+	pthread_rwlock_init(&ctx->dirLock, NULL);
+	pthread_mutex_init(&ctx->fdLock, NULL);
+	pthread_mutex_init(&ctx->fatLock, NULL);
+	pthread_mutex_init(&ctx->aioLock, NULL);
+	pthread_cond_init(&ctx->aioQueued, NULL);
+	pthread_cond_init(&ctx->aioDone, NULL);
+	pthread_mutex_init(&ctx->flushLock, NULL);
+	pthread_condattr_t flush_attr;
+	pthread_condattr_init(&flush_attr);
+	pthread_condattr_setclock(&flush_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->flushWake, &flush_attr);
+	pthread_condattr_destroy(&flush_attr);
+
+	// the descriptor table starts empty and grows as files are opened
+	ctx->fdMax = FS_OPEN_MAX_COUNT;
+	if(opts != NULL && opts->open_max != 0){
+		ctx->fdMax = (opts->open_max < FD_LIMIT) ? (int)opts->open_max : FD_LIMIT;
+	}
+	ctx->fdChunks = (fd**)calloc((ctx->fdMax + FD_CHUNK - 1) / FD_CHUNK, sizeof(fd*));
+	if(ctx->fdChunks == NULL){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	ctx->disk = disk_open(diskname, disk_flags);
+	if(ctx->disk == NULL){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+
+	//read the superblock and check if its correct
+	if(disk_read(ctx->disk, 0, &ctx->superblock) == -1
+	|| memcmp(ctx->superblock.signature, FS_SIGNATURE, 8) != 0
+	|| ctx->superblock.virBlkAmt != disk_count(ctx->disk)){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	// finish the last journal group before reading any metadata
+	if(ctx->superblock.journalBlkAmt != 0 && fs_journal_replay(ctx) == -1){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+
+	// initialize root directory by reading it
+	if(disk_read(ctx->disk, ctx->superblock.rootIndex, &ctx->rootDir) == -1){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	fs_name_rebuild(ctx);
+	ctx->rootDirty = 0;
+
+	// a clean unmount saved the free counters; they still hold unless the root
+	// directory was changed since, by another implementation for instance
+	int counted = ctx->superblock.clean && ctx->superblock.rootFree == ctx->rootFreeCount
+	&& ctx->superblock.fatFree <= ctx->superblock.dataBlkAmt
+	&& ctx->superblock.rootSum == fs_journal_sum(JOURNAL_SUM_SEED, ctx->rootDir, BLOCK_SIZE);
+	ctx->metaLazy = (opts != NULL && (opts->flags & FS_MOUNT_LAZY));
+	
+
+
+	ctx->fatDirty = (uint8_t*)calloc(ctx->superblock.fatBlkAmt, sizeof(uint8_t));
+	if(ctx->fatDirty == NULL){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	if(opts != NULL && (opts->flags & FS_MOUNT_PAGED_FAT)){
+		// map the FAT instead of reading it, its blocks are only read when first
+		// accessed and modified ones stay in memory until written back
+		ctx->fatPaged = 1;
+		ctx->FAT_array = (uint16_t*)disk_map_private(ctx->disk, 1, ctx->superblock.fatBlkAmt);
+		if(ctx->FAT_array == NULL){
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+	}else{
+		// FAT is allocated in whole blocks so it can be moved with one vectored
+		// call and aligned on a block so it can be used for direct I/O
+		if(posix_memalign((void**)&ctx->FAT_array, BLOCK_SIZE, ctx->superblock.fatBlkAmt * BLOCK_SIZE) != 0){
+			ctx->FAT_array = NULL;
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+
+		// read the whole FAT in one go
+		struct iovec fat_vec = {
+			.iov_base = ctx->FAT_array,
+			.iov_len = ctx->superblock.fatBlkAmt * BLOCK_SIZE
+		};
+		if(disk_readv(ctx->disk, 1, &fat_vec, 1) == -1){
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+	}
+
+	// the free block index is only needed once blocks are allocated or
+	// released, so skip the FAT scan when the free counter was saved
+	ctx->freeMap = (uint64_t*)calloc((ctx->superblock.dataBlkAmt + 63) / 64, sizeof(uint64_t));
+	ctx->freeLoaded = (uint8_t*)calloc(ctx->superblock.fatBlkAmt, sizeof(uint8_t));
+	if(ctx->freeMap == NULL || ctx->freeLoaded == NULL){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+	ctx->freeHint = 0;
+
+	if(counted){
+		ctx->fatFreeCount = ctx->superblock.fatFree;
+	}else{
+		// the pending frees of FS_MOUNT_DEFER_FREE only live in memory, give
+		// back the blocks they held if the last mount did not end cleanly
+		if(fs_fat_sweep(ctx) == -1){
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+		ctx->fatFreeCount = 0;
+		for(int i = 0; i < ctx->superblock.fatBlkAmt; i++){
+			ctx->fatFreeCount += fs_free_map_load(ctx, i);
+		}
+	}
+
+	if(opts != NULL && (opts->flags & FS_MOUNT_JOURNAL) && ctx->superblock.journalBlkAmt == 0
+	&& fs_journal_create(ctx) == -1){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	ctx->deferFree = (opts != NULL && (opts->flags & FS_MOUNT_DEFER_FREE));
+	if(ctx->superblock.journalBlkAmt != 0){
+		ctx->pendingFree = (uint16_t*)malloc(ctx->superblock.dataBlkAmt * sizeof(uint16_t));
+		if(ctx->pendingFree == NULL){
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+	}
+
+	
+	// a mapped disk already serves blocks from memory
+	size_t cache_blocks = 0;
+	if(opts != NULL && !(disk_flags & BLOCK_DISK_MMAP)){
+		cache_blocks = opts->cache_blocks;
+	}
+	ctx->cache = cache_init(ctx->disk, cache_blocks);
+	if(ctx->cache == NULL){
+		fs_ctx_free(ctx);
+		return NULL;
+	}
+
+	if(opts != NULL && (opts->flags & FS_MOUNT_FLUSH)){
+		unsigned int age = opts->flush_age_ms ? opts->flush_age_ms : FS_FLUSH_AGE_MS;
+		unsigned int ratio = opts->flush_ratio ? opts->flush_ratio : FS_FLUSH_RATIO;
+		ctx->flushAge = (uint64_t)age * 1000000;
+		ctx->flushKeep = cache_blocks * (ratio < 100 ? ratio : 100) / 100;
+		if(fs_flush_start(ctx) == -1){
+			fs_ctx_free(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+
+/**
+ * fs_umount_ctx - Unmount a file system and release its context
+ * @ctx: File system context
+ *
+ * Unmount file system @ctx and close the underlying virtual disk file.
+ * The numbers of free data blocks and free root directory entries are saved
+ * in the superblock, so that the next mount does not have to count them.
+ *
+ * Return: -1 if @ctx is NULL, or if there are still open file descriptors, or
+ * if the pending updates cannot be written back, in which case @ctx stays
+ * mounted. 0 otherwise, and @ctx can no longer be used.
+ */
+int fs_umount_ctx(fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+
+	if(__atomic_load_n(&ctx->fdOpen, __ATOMIC_ACQUIRE) != 0){
+		return -1;
+	}
+
+	// requests still queued can only fail now that every descriptor is closed
+	fs_aio_stop(ctx);
+	fs_flush_stop(ctx);
+
+	// release the blocks of deleted files, then write back the metadata and the
+	// cached data blocks before the disk goes away
+	fs_reclaim_blocks(ctx, 0);
+	if(fs_meta_flush(ctx) == -1 || cache_flush(ctx->cache) == -1 || fs_sb_clean(ctx) == -1
+	|| disk_sync(ctx->disk) == -1){
+		fs_flush_start(ctx);
+		return -1;
+	}
+
+	// nothing is left to write back, closing the disk cannot lose anything
+	fs_ctx_free(ctx);
+
+	return 0;
+}
+
+
+/**
+ * fs_sync_ctx - Flush file system to disk
+ * @ctx: File system context
+ *
+ * Write back the pending root directory and FAT updates and every dirty block
+ * held in the block cache, then flush the virtual disk file.
+ *
+ * Return: -1 if @ctx is NULL, or if the blocks cannot be written
+ * back. 0 otherwise.
+ */
+int fs_sync_ctx(fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->fatLock);
+	int ret = fs_meta_flush(ctx);
+	pthread_mutex_unlock(&ctx->fatLock);
+
+	if(ret == -1 || cache_flush(ctx->cache) == -1){
+		return -1;
+	}
+
+	return disk_sync(ctx->disk);
+}
+
+
+/**
+ * fs_fsync_ctx - Flush a file to disk
+ * @ctx: File system context
+ * @fd: File descriptor
+ *
+ * Make the contents and the size of the file referenced by file descriptor @fd
+ * durable. The root directory and the FAT are shared by all files, so the
+ * pending updates to them are written back as a whole.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the blocks cannot be
+ * written back. 0 otherwise.
+ */
+int fs_fsync_ctx(fs_ctx *ctx, int fd)
+{
+	if(fs_fd_get(ctx, fd) == -1){
+		return -1;
+	}
+	fs_fd_put(ctx, fd);
+
+	return fs_sync_ctx(ctx);
+}
+
+
+/**
+ * fs_cache_stats_ctx - Get block cache counters
+ * @ctx: File system context
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if @ctx is NULL, or if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats_ctx(fs_ctx *ctx, struct fs_cache_stats *stats)
+{
+	if(ctx == NULL || stats == NULL){
+		return -1;
+	}
+
+	struct cache_stats cs;
+	cache_get_stats(ctx->cache, &cs);
+	stats->hits = cs.hits;
+	stats->misses = cs.misses;
+	stats->writebacks = cs.writebacks;
+	stats->dirty = cs.dirty;
+	stats->flushes = cs.flushes;
+	stats->flush_us = cs.flush_ns / 1000;
+	stats->flush_us_max = cs.flush_ns_max / 1000;
+
+	return 0;
+}
+
+
+/**
+ * fs_info_ctx - Display information about file system
+ * @ctx: File system context
+ *
+ * Display some information about file system @ctx.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_info_ctx(fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+
+	printf("FS Info:\n");
+    printf("total_blk_count=%d\n",ctx->superblock.virBlkAmt);
+    printf("fat_blk_count=%d\n",ctx->superblock.fatBlkAmt);
+    printf("rdir_blk=%d\n",ctx->superblock.rootIndex);
+    printf("data_blk=%d\n",ctx->superblock.dataIndex);
+    printf("data_blk_count=%d\n",ctx->superblock.dataBlkAmt);
+	pthread_rwlock_rdlock(&ctx->dirLock);
+	pthread_mutex_lock(&ctx->fatLock);
+    printf("fat_free_ratio=%d/%d\n", ctx->fatFreeCount, ctx->superblock.dataBlkAmt);
+    printf("rdir_free_ratio=%d/%d\n", ctx->rootFreeCount, FS_FILE_MAX_COUNT);
+	pthread_mutex_unlock(&ctx->fatLock);
+	pthread_rwlock_unlock(&ctx->dirLock);
+
+    return 0;
+}
+
+
+/**
+ * fs_create_ctx - Create a new file
+ * @ctx: File system context
+ * @filename: File name
+ *
+ * Create a new and empty file named @filename in the root directory of the
+ * mounted file system. String @filename must be NULL-terminated and its total
+ * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character).
+ *
+ * Return: -1 if @ctx is NULL, or if @filename is invalid, or if a
+ * file named @filename already exists, or if string @filename is too long, or
+ * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ */
+int fs_create_ctx(fs_ctx *ctx, const char *filename)
+{
+	if(ctx == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN){
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&ctx->dirLock);
+
+	int j = -1;
+	if(fs_name_find(ctx, filename) == -1){
+		j = fs_root_alloc(ctx);
+	}
+	if(j == -1){
+		pthread_rwlock_unlock(&ctx->dirLock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->fatLock);
+	strcpy(ctx->rootDir[j].filename, filename);
+
+	ctx->rootDir[j].file_size = 0;
+	ctx->rootDir[j].index_first = FAT_EOC;
+
+	int ret = fs_meta_update(ctx);
+	if(ret == -1){
+		ctx->rootDir[j].filename[0] = '\0';
+	}
+	pthread_mutex_unlock(&ctx->fatLock);
+
+	if(ret == 0){
+		fs_name_insert(ctx, j);
+	}
+	pthread_rwlock_unlock(&ctx->dirLock);
+
+	return ret;
+}
+
+// update a FAT entry and remember which FAT block needs to be written back,
+// keeping the free block index and counter in sync
+void fs_fat_set(fs_ctx *ctx, uint16_t loc, uint16_t value){
+	uint64_t bit = (uint64_t)1 << (loc % 64);
+
+	fs_free_map_load(ctx, loc / Half);
+
+	if(ctx->FAT_array[loc] == 0 && value != 0){
+		ctx->freeMap[loc / 64] &= ~bit;
+		ctx->fatFreeCount--;
+	} else if(ctx->FAT_array[loc] != 0 && value == 0){
+		ctx->fatFreeCount++;
+		if(ctx->superblock.journalBlkAmt != 0){
+			ctx->pendingFree[ctx->pendingCount++] = loc;
+		} else {
+			ctx->freeMap[loc / 64] |= bit;
+			if(loc / 64 < ctx->freeHint){
+				ctx->freeHint = loc / 64;
+			}
+		}
+	}
+
+	ctx->FAT_array[loc] = value;
+	ctx->fatDirty[loc / Half] = 1;
+}
+
+// find the lowest free data block, FAT_EOC if the disk is full
+uint16_t fs_fat_alloc(fs_ctx *ctx){
+	int words = (ctx->superblock.dataBlkAmt + 63) / 64;
+
+	for(; ctx->freeHint < words; ctx->freeHint++){
+		uint64_t bits = fs_free_word(ctx, ctx->freeHint);
+		if(bits != 0){
+			return ctx->freeHint * 64 + __builtin_ctzll(bits);
+		}
+	}
+
+	// chains of deleted files left for later are released when space runs out
+	if(ctx->reclaimLen > 0){
+		fs_reclaim_blocks(ctx, 0);
+		return fs_fat_alloc(ctx);
+	}
+
+	// blocks freed by the current journal group become usable once it commits
+	if(ctx->pendingCount > 0 && fs_journal_commit(ctx) == 0){
+		return fs_fat_alloc(ctx);
+	}
+
+	return FAT_EOC;
+}
+
+// find a free data block at or after @goal so chains stay contiguous, or the
+// lowest free one if there is none
+uint16_t fs_fat_alloc_near(fs_ctx *ctx, uint16_t goal){
+	int words = (ctx->superblock.dataBlkAmt + 63) / 64;
+
+	if(goal < ctx->superblock.dataBlkAmt){
+		int word = goal / 64;
+		uint64_t bits = fs_free_word(ctx, word) & (~(uint64_t)0 << (goal % 64));
+
+		for(;;){
+			if(bits != 0){
+				return word * 64 + __builtin_ctzll(bits);
+			}
+			if(++word == words){
+				break;
+			}
+			bits = fs_free_word(ctx, word);
+		}
+	}
+
+	return fs_fat_alloc(ctx);
+}
+
+// find the first run of @len free data blocks, looking at or after @goal
+// first, FAT_EOC if the free space is too fragmented
+uint16_t fs_fat_find_run(fs_ctx *ctx, uint16_t goal, int len){
+	int start = 0;
+	int run = 0;
+
+	if(goal >= ctx->superblock.dataBlkAmt){
+		goal = 0;
+	}
+
+	for(int pass = 0; pass < 2; pass++){
+		int i = (pass == 0) ? goal : 0;
+		int end = (pass == 0) ? ctx->superblock.dataBlkAmt : goal;
+
+		run = 0;
+		while(i < end){
+			// skip whole words of used blocks
+			if(i % 64 == 0 && fs_free_word(ctx, i / 64) == 0){
+				run = 0;
+				i += 64;
+				continue;
+			}
+
+			if(fs_free_word(ctx, i / 64) & ((uint64_t)1 << (i % 64))){
+				if(run == 0){
+					start = i;
+				}
+				if(++run == len){
+					return start;
+				}
+			} else {
+				run = 0;
+			}
+			i++;
+		}
+	}
+
+	return FAT_EOC;
+}
+
+// forget the block map of the file in root directory entry @root
+void fs_chain_map_drop(fs_ctx *ctx, int root){
+	free(ctx->chainMap[root].blocks);
+	memset(&ctx->chainMap[root], 0, sizeof(cm));
+}
+
+// add @block at the end of the block map of the file in root entry @root
+int fs_chain_map_push(fs_ctx *ctx, int root, uint16_t block){
+	cm *map = &ctx->chainMap[root];
+
+	if(map->len == map->cap){
+		int cap = map->cap ? 2 * map->cap : 64;
+		uint16_t *blocks = (uint16_t*)realloc(map->blocks, cap * sizeof(uint16_t));
+		if(blocks == NULL){
+			fs_chain_map_drop(ctx, root);
+			return -1;
+		}
+		map->blocks = blocks;
+		map->cap = cap;
+	}
+	map->blocks[map->len++] = block;
+
+	return 0;
+}
+
+// record every block of the chain of the file in root directory entry @root
+int fs_chain_map_build(fs_ctx *ctx, int root){
+	fs_chain_map_drop(ctx, root);
+	for(uint16_t curr = ctx->rootDir[root].index_first; curr != FAT_EOC; curr = ctx->FAT_array[curr]){
+		if(fs_chain_map_push(ctx, root, curr) == -1){
+			return -1;
+		}
+	}
+	ctx->chainMap[root].built = 1;
+
+	return 0;
+}
+
+// block @block was linked as logical block @index of the file in root
+// directory entry @root: extend its map, or drop it if it cannot follow
+void fs_chain_map_append(fs_ctx *ctx, int root, int index, uint16_t block){
+	if(!ctx->chainMap[root].built){
+		return;
+	}
+
+	if(index != ctx->chainMap[root].len){
+		fs_chain_map_drop(ctx, root);
+		return;
+	}
+
+	fs_chain_map_push(ctx, root, block);
+}
+
+/**
+ * fs_delete_ctx - Delete a file
+ * @ctx: File system context
+ * @filename: File name
+ *
+ * Delete the file named @filename from the root directory of the mounted file
+ * system.
+ *
+ * Return: -1 if @ctx is NULL, or if @filename is invalid, or if there is no
+ * file named @filename to delete, or if file @filename is currently open. 0
+ * otherwise.
+ */
+int fs_delete_ctx(fs_ctx *ctx, const char *filename) {
+	if(ctx == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN){
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&ctx->dirLock);
+
+	// no descriptor can be opened while the directory is locked
+	int i = fs_name_find(ctx, filename);
+	if(i == -1 || __atomic_load_n(&ctx->openCount[i], __ATOMIC_ACQUIRE) != 0){
+		pthread_rwlock_unlock(&ctx->dirLock);
+		return -1;
+	}
+
+	// the last fs_close_ctx() of the file may still be about to drop its block
+	// map, the file lock orders that with the drop below
+	pthread_rwlock_wrlock(&ctx->fileLock[i]);
+	pthread_mutex_lock(&ctx->fatLock);
+	uint16_t first = ctx->rootDir[i].index_first;
+	if(ctx->deferFree && first != FAT_EOC){
+		if(ctx->reclaimLen == ctx->reclaimCap){
+			int cap = (ctx->reclaimCap == 0) ? FS_FILE_MAX_COUNT : ctx->reclaimCap * 2;
+			uint16_t *list = (uint16_t*)realloc(ctx->reclaimList, cap * sizeof(uint16_t));
+			if(list == NULL){
+				pthread_mutex_unlock(&ctx->fatLock);
+				pthread_rwlock_unlock(&ctx->fileLock[i]);
+				pthread_rwlock_unlock(&ctx->dirLock);
+				return -1;
+			}
+			ctx->reclaimList = list;
+			ctx->reclaimCap = cap;
+		}
+		ctx->reclaimList[ctx->reclaimLen++] = first;
+	} else {
+		fs_fat_release(ctx, first, ctx->superblock.dataBlkAmt);
+	}
+	fs_chain_map_drop(ctx, i);
+	fs_name_remove(ctx, i);
+	ctx->rootDir[i].filename[0] = '\0';
+	ctx->rootDir[i].file_size = 0;
+	ctx->rootDir[i].index_first = 0;
+
+	// too many tombstones make lookups walk long probe sequences
+	if(ctx->nameDeleted > NAME_HASH_SIZE / 4){
+		fs_name_rebuild(ctx);
+	}
+	
+	// write changes to the FAT and the root onto disk
+	int ret = fs_meta_update(ctx);
+	pthread_mutex_unlock(&ctx->fatLock);
+	pthread_rwlock_unlock(&ctx->fileLock[i]);
+	pthread_rwlock_unlock(&ctx->dirLock);
+
+	return ret;
+}
+
+
+/**
+ * fs_reclaim_ctx - Release the blocks of deleted files
+ * @ctx: File system context
+ * @max_blocks: Maximum number of blocks to release, or 0 for all of them
+ *
+ * When the file system is mounted with %FS_MOUNT_DEFER_FREE, fs_delete_ctx()
+ * only removes the file from the root directory and leaves its data blocks to
+ * this function, so that it can be called when the application is idle. Blocks
+ * that are still pending are also released when the disk runs out of free
+ * blocks and when the file system is unmounted.
+ *
+ * Return: -1 if @ctx is NULL, or if the FAT cannot be written
+ * back. Otherwise, the number of blocks released.
+ */
+int fs_reclaim_ctx(fs_ctx *ctx, size_t max_blocks)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+
+	int max = (max_blocks == 0 || max_blocks > ctx->superblock.dataBlkAmt) ? 0 : (int)max_blocks;
+
+	pthread_mutex_lock(&ctx->fatLock);
+	int freed = fs_reclaim_blocks(ctx, max);
+	if(freed > 0 && fs_meta_update(ctx) == -1){
+		freed = -1;
+	}
+	pthread_mutex_unlock(&ctx->fatLock);
+
+	return freed;
+}
+
+
+/**
+ * fs_ls_ctx - List files on file system
+ * @ctx: File system context
+ *
+ * List information about the files located in the root directory.
+ *
+ * Return: -1 if @ctx is NULL. 0 otherwise.
+ */
+int fs_ls_ctx(fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	
+	pthread_rwlock_rdlock(&ctx->dirLock);
+	pthread_mutex_lock(&ctx->fatLock);
+	printf("FS Ls:\n");
+	for(size_t i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(ctx->rootDir[i].filename[0] != '\0'){
+			printf("file: %s, size: %d, data_blk: %d\n", 
+			ctx->rootDir[i].filename, ctx->rootDir[i].file_size, ctx->rootDir[i].index_first);
+		}
+	}
+	pthread_mutex_unlock(&ctx->fatLock);
+	pthread_rwlock_unlock(&ctx->dirLock);
+	return 0;
+}
+
+
+/**
+ * fs_open_ctx - Open a file
+ * @ctx: File system context
+ * @filename: File name
+ *
+ * Open file named @filename for reading and writing, and return the
+ * corresponding file descriptor. The file descriptor is a non-negative integer
+ * that is used subsequently to access the contents of the file. The file offset
+ * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * same file is opened multiple files, fs_open_ctx() must return distinct file
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
+ * simultaneously, unless the file system was mounted with a different
+ * @opts->open_max.
+ *
+ * Return: -1 if @ctx is NULL, or if @filename is invalid, or if
+ * there is no file named @filename to open, or if the maximum number of files
+ * are currently open. Otherwise, return the file
+ * descriptor.
+ */
+int fs_open_ctx(fs_ctx *ctx, const char *filename)
+{
+	if(ctx == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN){
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&ctx->dirLock);
+	int root = fs_name_find(ctx, filename);
+	if(root == -1){
+		pthread_rwlock_unlock(&ctx->dirLock);
+		return -1;
+	}
+
+	int ret = fs_fd_alloc(ctx);
+	if(ret != -1){
+		pthread_rwlock_wrlock(&FD_ENTRY(ctx, ret).lock);
+		FD_ENTRY(ctx, ret).table_offset = 0;
+		FD_ENTRY(ctx, ret).loc = root;
+		FD_ENTRY(ctx, ret).cursor_index = -1;
+		pthread_rwlock_unlock(&FD_ENTRY(ctx, ret).lock);
+		__atomic_add_fetch(&ctx->openCount[root], 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&ctx->dirLock);
+	
+	return ret;
+
+}
+
+
+/**
+ * fs_close_ctx - Close a file
+ * @ctx: File system context
+ * @fd: File descriptor
+ *
+ * Close file descriptor @fd.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_close_ctx(fs_ctx *ctx, int fd)
+{
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
+
+	FD_ENTRY(ctx, fd).loc = -1;
+	FD_ENTRY(ctx, fd).table_offset = -1;
+	FD_ENTRY(ctx, fd).cursor_index = -1;
+	fs_fd_put(ctx, fd);
+
+	fs_fd_release(ctx, fd, fd);
+	__atomic_sub_fetch(&ctx->fdOpen, 1, __ATOMIC_RELEASE);
+
+	// the block map is only kept while the file is open
+	if(__atomic_sub_fetch(&ctx->openCount[root], 1, __ATOMIC_ACQ_REL) == 0){
+		pthread_rwlock_wrlock(&ctx->fileLock[root]);
+		if(__atomic_load_n(&ctx->openCount[root], __ATOMIC_ACQUIRE) == 0){
+			fs_chain_map_drop(ctx, root);
+		}
+		pthread_rwlock_unlock(&ctx->fileLock[root]);
+	}
+
+	return 0;
+}
+
+
+/**
+ * fs_stat_ctx - Get file status
+ * @ctx: File system context
+ * @fd: File descriptor
+ *
+ * Get the current size of the file pointed by file descriptor @fd.
+ *
+ * Return: -1 if @ctx is NULL, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the current
+ * size of file.
+ */
+int fs_stat_ctx(fs_ctx *ctx, int fd)
+{
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&ctx->fileLock[root]);
+	int size = ctx->rootDir[root].file_size;
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return size;
+}
+
+
+/**
+ * fs_lseek_ctx - Set file offset
+ * @ctx: File system context
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Set the file offset (used for read and write operations) associated with file
+ * descriptor @fd to the argument @offset. To append to a file, one can call
+ * fs_lseek_ctx(ctx, fd, fs_stat_ctx(ctx, fd));
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
+ * than the current file size. 0 otherwise.
+ */
+int fs_lseek_ctx(fs_ctx *ctx, int fd, size_t offset)
+{
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&ctx->fileLock[root]);
+	if(offset > ctx->rootDir[root].file_size){
+		pthread_rwlock_unlock(&ctx->fileLock[root]);
+		fs_fd_put(ctx, fd);
+		return -1;
+	}
+
+	FD_ENTRY(ctx, fd).table_offset = offset;
+
+	// rewinding before the cursor restarts the chain from its first block
+	if((int)offset / BLOCK_SIZE < FD_ENTRY(ctx, fd).cursor_index){
+		FD_ENTRY(ctx, fd).cursor_index = -1;
+		if(ctx->rootDir[root].index_first != FAT_EOC){
+			FD_ENTRY(ctx, fd).cursor_index = 0;
+			FD_ENTRY(ctx, fd).cursor_block = ctx->rootDir[root].index_first;
+		}
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return 0;
+}
+
+
+// find the data block holding logical block @index of the file in root
+// directory entry @root, resuming from the cursor of descriptor @fd (unless it
+// is -1) when it is not past @index, or using the file's block map for long
+// walks. @prev gets the block before it, which is the chain's tail when @index
+// is past its end
+uint16_t fs_chain_lookup(fs_ctx *ctx, int fd, int root, int index, uint16_t *prev){
+	cm *map = &ctx->chainMap[root];
+	uint16_t curr = ctx->rootDir[root].index_first;
+	int i = 0;
+
+	if(fd != -1 && FD_ENTRY(ctx, fd).cursor_index != -1 && FD_ENTRY(ctx, fd).cursor_index <= index){
+		i = FD_ENTRY(ctx, fd).cursor_index;
+		curr = FD_ENTRY(ctx, fd).cursor_block;
+	}
+
+	// readers of the same file share its map
+	pthread_mutex_lock(&ctx->mapLock[root]);
+	if(!map->built && index - i > CHAIN_WALK_MAX){
+		fs_chain_map_build(ctx, root);
+	}
+
+	if(map->built && index <= map->len){
+		if(map->len == 0){
+			*prev = FAT_EOC;
+			curr = FAT_EOC;
+		} else {
+			*prev = map->blocks[index > 0 ? index - 1 : 0];
+			curr = (index < map->len) ? map->blocks[index] : FAT_EOC;
+		}
+		pthread_mutex_unlock(&ctx->mapLock[root]);
+		return curr;
+	}
+	pthread_mutex_unlock(&ctx->mapLock[root]);
+
+	*prev = curr;
+	for(; i < index && curr != FAT_EOC; i++){
+		*prev = curr;
+		curr = ctx->FAT_array[curr];
+	}
+
+	return curr;
+}
+
+// remember that logical block @index of the file open as @fd is @block, unless
+// @fd is -1
+void fs_chain_remember(fs_ctx *ctx, int fd, int index, uint16_t block){
+	if(fd == -1){
+		return;
+	}
+	FD_ENTRY(ctx, fd).cursor_index = index;
+	FD_ENTRY(ctx, fd).cursor_block = block;
+}
+
+
+// reserve blocks for @size bytes in the file in root directory entry @root,
+// with the file locked for writing
+int fs_file_fallocate(fs_ctx *ctx, int root, size_t size){
+	size_t want = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t have = 0;
+	uint16_t last = FAT_EOC;
+
+	for(uint16_t curr = ctx->rootDir[root].index_first; curr != FAT_EOC; curr = ctx->FAT_array[curr]){
+		last = curr;
+		have++;
+	}
+
+	if(want <= have){
+		return 0;
+	}
+
+	int need = want - have;
+	pthread_mutex_lock(&ctx->fatLock);
+	if(need > ctx->fatFreeCount && ctx->reclaimLen > 0){
+		fs_reclaim_blocks(ctx, 0);
+	}
+	if(need > ctx->fatFreeCount){
+		pthread_mutex_unlock(&ctx->fatLock);
+		return -1;
+	}
+
+	uint16_t goal = (last == FAT_EOC) ? 0 : last + 1;
+	uint16_t start = fs_fat_find_run(ctx, goal, need);
+	uint16_t tail = last;
+	uint16_t added = FAT_EOC;
+
+	for(int i = 0; i < need; i++){
+		// fall back to block by block when no run is large enough
+		uint16_t blk = (start != FAT_EOC) ? start + i : fs_fat_alloc_near(ctx, goal);
+
+		// the free counter was wrong, give back the blocks added so far
+		if(blk == FAT_EOC){
+			if(tail == FAT_EOC){
+				ctx->rootDir[root].index_first = FAT_EOC;
+			} else {
+				fs_fat_set(ctx, tail, FAT_EOC);
+			}
+			if(added != FAT_EOC){
+				fs_fat_release(ctx, added, need);
+			}
+			fs_chain_map_drop(ctx, root);
+			pthread_mutex_unlock(&ctx->fatLock);
+			return -1;
+		}
+		if(added == FAT_EOC){
+			added = blk;
+		}
+
+		if(last == FAT_EOC){
+			ctx->rootDir[root].index_first = blk;
+		} else {
+			fs_fat_set(ctx, last, blk);
+		}
+		fs_fat_set(ctx, blk, FAT_EOC);
+		fs_chain_map_append(ctx, root, have + i, blk);
+		last = blk;
+		goal = blk + 1;
+	}
+
+	int ret = fs_meta_update(ctx);
+	pthread_mutex_unlock(&ctx->fatLock);
+
+	return ret;
+}
+
+
+/**
+ * fs_fallocate_ctx - Reserve space for a file
+ * @ctx: File system context
+ * @fd: File descriptor
+ * @size: Number of bytes to reserve
+ *
+ * Make sure the file referenced by file descriptor @fd has data blocks for at
+ * least @size bytes, allocating the missing blocks as one contiguous extent
+ * next to the file's last block whenever the free space allows it. The file
+ * size is left unchanged: the reserved blocks are used by subsequent writes
+ * past the end of the file.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there is not enough free
+ * space on disk. 0 otherwise.
+ */
+int fs_fallocate_ctx(fs_ctx *ctx, int fd, size_t size)
+{
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&ctx->fileLock[root]);
+	int ret = fs_file_fallocate(ctx, root, size);
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return ret;
+}
+
+
+// pointer to byte @pos of the data behind @cur, with in @len the number of
+// bytes that follow it in the same buffer
+uint8_t *fs_iov_at(ic *cur, size_t pos, size_t *len){
+	while(cur->seg > 0 && pos < cur->base){
+		cur->seg--;
+		cur->base -= cur->iov[cur->seg].iov_len;
+	}
+	while(pos >= cur->base + cur->iov[cur->seg].iov_len){
+		cur->base += cur->iov[cur->seg].iov_len;
+		cur->seg++;
+	}
+
+	*len = cur->base + cur->iov[cur->seg].iov_len - pos;
+	return (uint8_t*)cur->iov[cur->seg].iov_base + (pos - cur->base);
+}
+
+// copy @len bytes from position @pos of the data behind @cur to @buf, or the
+// other way around when @in is set
+void fs_iov_copy(ic *cur, size_t pos, void *buf, size_t len, int in){
+	uint8_t *bytes = (uint8_t*)buf;
+
+	while(len > 0){
+		size_t avail;
+		uint8_t *p = fs_iov_at(cur, pos, &avail);
+		size_t n = (avail < len) ? avail : len;
+
+		if(in){
+			memcpy(p, bytes, n);
+		} else {
+			memcpy(bytes, p, n);
+		}
+		bytes += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+// total size of the @iovcnt buffers of @iov, -1 if they are invalid or hold
+// more than a file can
+long fs_iov_size(const struct iovec *iov, int iovcnt){
+	long total = 0;
+
+	if(iov == NULL || iovcnt <= 0){
+		return -1;
+	}
+	for(int i = 0; i < iovcnt; i++){
+		if(iov[i].iov_base == NULL && iov[i].iov_len != 0){
+			return -1;
+		}
+		if(iov[i].iov_len > (size_t)INT32_MAX - total){
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+// write the @count bytes held by the @iovcnt buffers of @iov at offset @pos of
+// the file in root directory entry @root, which is locked for writing, using
+// the cursor of descriptor @fd unless it is -1. The offset of the descriptor is
+// left to the caller
+int fs_file_write(fs_ctx *ctx, int fd, int root, const struct iovec *iov, int iovcnt, size_t count, size_t pos){
+	ic cur = { iov, iovcnt, 0, 0 };
+	int amount_written = 0;
+	int bytes = 0;
+	int offset = pos;
+	int first = offset / BLOCK_SIZE;
+	int block_offset;
+	if (offset % BLOCK_SIZE == 0) {
+    	block_offset = 0;
+	} else {
+    	block_offset = offset - (first * BLOCK_SIZE);
+	}
+
+	uint16_t first_data_block = ctx->rootDir[root].index_first;
+	uint32_t file_size = ctx->rootDir[root].file_size;
+	// current block was just allocated, its content is garbage
+	int fresh = (first_data_block == FAT_EOC);
+
+	// take the staging buffer first, so that failing to get one leaves
+	// nothing allocated behind
+	uint8_t *written = cache_buf_get(ctx->cache);
+	struct block_req reqs[FS_BATCH_BLOCKS];
+	if(written == NULL){
+		return 0;
+	}
+
+	if(first_data_block == FAT_EOC){
+		pthread_mutex_lock(&ctx->fatLock);
+		first_data_block = fs_fat_alloc(ctx);
+		if(first_data_block != FAT_EOC){
+			ctx->rootDir[root].index_first = first_data_block;
+			fs_fat_set(ctx, first_data_block, FAT_EOC);
+		}
+		pthread_mutex_unlock(&ctx->fatLock);
+
+		// disk is full
+		if(first_data_block == FAT_EOC){
+			cache_buf_put(ctx->cache, written);
+			return 0;
+		}
+		fs_chain_map_append(ctx, root, 0, first_data_block);
+	}
+
+	uint16_t prev;
+	int curr = fs_chain_lookup(ctx, fd, root, first, &prev);
+	int index = first;
+
+	while(count > 0){
+		// gather the next run of the chain, growing it when needed
+		struct block_req reads[FS_BATCH_BLOCKS];
+		int n = 0;
+		int nreads = 0;
+		size_t span = 0;
+		while(n < FS_BATCH_BLOCKS && span < count){
+			if(curr == FAT_EOC){
+				pthread_mutex_lock(&ctx->fatLock);
+				curr = fs_fat_alloc_near(ctx, prev + 1);
+				if(curr != FAT_EOC){
+					fs_fat_set(ctx, prev, curr);
+					fs_fat_set(ctx, curr, FAT_EOC);
+				}
+				pthread_mutex_unlock(&ctx->fatLock);
+
+				if(curr != FAT_EOC){
+					fs_chain_map_append(ctx, root, index + n, curr);
+					fresh = 1;
+				}
+			}
+
+			// disk is full
+			if(curr == FAT_EOC){
+				break;
+			}
+
+			int head = (n == 0) ? block_offset : 0;
+			if(count - span < (size_t)(BLOCK_SIZE - head)){
+				bytes = count - span;
+			} else {
+				bytes = BLOCK_SIZE - head;
+			}
+
+			reqs[n].block = curr + ctx->superblock.dataIndex;
+			reqs[n].write = 1;
+			size_t avail = 0;
+			uint8_t *src = (bytes == BLOCK_SIZE) ? fs_iov_at(&cur, amount_written + span, &avail) : NULL;
+			if(avail >= BLOCK_SIZE){
+				// whole blocks are written straight from the caller's buffer
+				reqs[n].buf = src;
+			} else if(bytes == BLOCK_SIZE){
+				// unless they straddle two of the caller's buffers
+				reqs[n].buf = &written[n * BLOCK_SIZE];
+			} else {
+				// partial blocks are merged with their current content, unless
+				// they were just allocated and hold nothing worth keeping
+				reqs[n].buf = &written[n * BLOCK_SIZE];
+				if(fresh){
+					memset(reqs[n].buf, 0, BLOCK_SIZE);
+				} else {
+					reads[nreads] = reqs[n];
+					reads[nreads].write = 0;
+					nreads++;
+				}
+			}
+
+			span += bytes;
+			n++;
+			fresh = 0;
+			prev = curr;
+			curr = ctx->FAT_array[prev];
+		}
+
+		if(n == 0){
+			break;
+		}
+
+		index += n;
+		fs_chain_remember(ctx, fd, index - 1, prev);
+
+		// read the partial blocks that need it in one batch
+		if(nreads > 0 && cache_batch(ctx->cache, reads, nreads) == -1){
+			break;
+		}
+
+		int run_offset = block_offset;
+		size_t run_bytes = 0;
+		for(int i = 0; i < n; i++){
+			if(count - run_bytes < (size_t)(BLOCK_SIZE - run_offset)){
+				bytes = count - run_bytes;
+			} else {
+				bytes = BLOCK_SIZE - run_offset;
+			}
+
+			if(reqs[i].buf == &written[i * BLOCK_SIZE]){
+				fs_iov_copy(&cur, amount_written + run_bytes, (uint8_t*)reqs[i].buf + run_offset, bytes, 0);
+			}
+			run_offset = 0;
+			run_bytes += bytes;
+		}
+
+		// then write the whole run back in one batch
+		if(cache_batch(ctx->cache, reqs, n) == -1){
+			break;
+		}
+
+		block_offset = 0;
+		amount_written += run_bytes;
+		count -= run_bytes;
+		offset += run_bytes;
+	}
+
+	cache_buf_put(ctx->cache, written);
+	fs_flush_kick(ctx);
+
+	pthread_mutex_lock(&ctx->fatLock);
+	if (offset > (int)file_size) {
+    	ctx->rootDir[root].file_size = offset;
+	} else {
+    	ctx->rootDir[root].file_size = file_size;
+	}
+	int ret = fs_meta_update(ctx);
+	pthread_mutex_unlock(&ctx->fatLock);
+
+	if(ret == -1){
+		return 0;
+	}
+
+	return amount_written;
+}
+
+
+/**
+ * fs_write_ctx - Write to a file
+ * @ctx: File system context
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Attempt to write @count bytes of data from buffer pointer by @buf into the
+ * file referenced by file descriptor @fd. It is assumed that @buf holds at
+ * least @count bytes.
+ *
+ * When the function attempts to write past the end of the file, the file is
+ * automatically extended to hold the additional bytes. If the underlying disk
+ * runs out of space while performing a write operation, fs_write_ctx() should
+ * write as many bytes as possible. The number of written bytes can therefore be
+ * smaller than @count (it can even be 0 if there is no more space on disk).
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually written.
+ */
+int fs_write_ctx(fs_ctx *ctx, int fd, void *buf, size_t count)
+{
+	if (buf == NULL || count == 0) {
+    	return -1;
+	}
+
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
+
+	struct iovec vec = { buf, count };
+	pthread_rwlock_wrlock(&ctx->fileLock[root]);
+	int ret = fs_file_write(ctx, fd, root, &vec, 1, count, FD_ENTRY(ctx, fd).table_offset);
+	if(ret > 0){
+		FD_ENTRY(ctx, fd).table_offset += ret;
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return ret;
+}
+
+
+// read up to @count bytes into the @iovcnt buffers of @iov from offset @pos of
+// the file in root directory entry @root, which is locked for reading, using
+// the cursor of descriptor @fd unless it is -1. The offset of the descriptor is
+// left to the caller
+int fs_file_read(fs_ctx *ctx, int fd, int root, const struct iovec *iov, int iovcnt, size_t count, size_t pos){
+	ic cur = { iov, iovcnt, 0, 0 };
+	int offset = pos;
+	int first = offset / BLOCK_SIZE;
+	int block_offset;
+	if (offset % BLOCK_SIZE == 0) {
+    	block_offset = 0;
+	} else {
+    	block_offset = offset - (first * BLOCK_SIZE);
+	}
+	int amount_read = 0;
+	int bytes = 0;
+
+	uint32_t file_size = ctx->rootDir[root].file_size;
+
+	// never read past the end of the file
+	if(offset >= (int)file_size){
+		return 0;
+	}
+	if(count > file_size - offset){
+		count = file_size - offset;
+	}
+
+	uint16_t prev;
+	int curr = fs_chain_lookup(ctx, fd, root, first, &prev);
+	int index = first;
+
+	uint8_t *read = cache_buf_get(ctx->cache);
+	struct block_req reqs[FS_BATCH_BLOCKS];
+	if(read == NULL){
+		return -1;
+	}
+
+	while(count > 0 && curr != FAT_EOC){
+		// gather the next run of the chain
+		int n = 0;
+		size_t span = 0;
+		while(n < FS_BATCH_BLOCKS && span < count && curr != FAT_EOC){
+			int head = (n == 0) ? block_offset : 0;
+
+			// whole blocks are read straight into the caller's buffer, only the
+			// partial head and tail blocks and the blocks straddling two of the
+			// caller's buffers go through the staging buffer
+			reqs[n].block = curr + ctx->superblock.dataIndex;
+			size_t avail = 0;
+			uint8_t *dst = NULL;
+			if(head == 0 && count - span >= BLOCK_SIZE){
+				dst = fs_iov_at(&cur, amount_read + span, &avail);
+			}
+			reqs[n].buf = (avail >= BLOCK_SIZE) ? dst : &read[n * BLOCK_SIZE];
+			reqs[n].write = 0;
+			span += BLOCK_SIZE - head;
+			n++;
+			prev = curr;
+			curr = ctx->FAT_array[curr];
+		}
+
+		index += n;
+		fs_chain_remember(ctx, fd, index - 1, prev);
+
+		// a mapped disk hands out the blocks directly, no bounce copy needed,
+		// otherwise the whole run is read in one batch
+		int mapped = disk_map(ctx->disk, reqs[0].block) != NULL;
+		if(!mapped && cache_batch(ctx->cache, reqs, n) == -1){
+			break;
+		}
+
+		for(int i = 0; i < n; i++){
+			const uint8_t *src = mapped ? disk_map(ctx->disk, reqs[i].block) : reqs[i].buf;
+
+			if(count < (size_t)(BLOCK_SIZE - block_offset)){
+				bytes = count;
+			} else {
+				bytes = BLOCK_SIZE - block_offset;
+			}
+
+			if(mapped || src == &read[i * BLOCK_SIZE]){
+				fs_iov_copy(&cur, amount_read, (uint8_t*)&src[block_offset], bytes, 1);
+			}
+
+			amount_read += bytes;
+			count -= bytes;
+			offset += bytes;
+			block_offset = 0;
+		}
+	}
+
+	cache_buf_put(ctx->cache, read);
+
+	return amount_read;
+}
+
+
+/**
+ * fs_read_ctx - Read from a file
+ * @ctx: File system context
  * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
  *
- * Get the current size of the file pointed by file descriptor @fd.
+ * Attempt to read @count bytes of data from the file referenced by file
+ * descriptor @fd into buffer pointer by @buf. It is assumed that @buf is large
+ * enough to hold at least @count bytes.
  *
- * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * The number of bytes read can be smaller than @count if there are less than
+ * @count bytes until the end of the file (it can even be 0 if the file offset
+ * is at the end of the file). The file offset of the file descriptor is
+ * implicitly incremented by the number of bytes that were actually read.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
  */
-int fs_stat(int fd)
+int fs_read_ctx(fs_ctx *ctx, int fd, void *buf, size_t count)
 {
-	if(!mounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || FD_table[fd].loc == -1){
+	if (buf == NULL || count == 0) {
+    	return -1;
+	}
+
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
 		return -1;
 	}
 
-	return (rootDir[FD_table[fd].loc].file_size);
+	struct iovec vec = { buf, count };
+	pthread_rwlock_rdlock(&ctx->fileLock[root]);
+	int ret = fs_file_read(ctx, fd, root, &vec, 1, count, FD_ENTRY(ctx, fd).table_offset);
+	if(ret > 0){
+		FD_ENTRY(ctx, fd).table_offset += ret;
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return ret;
 }
 
 
+
 /**
- * fs_lseek - Set file offset
+ * fs_writev_ctx - Write to a file from several buffers
+ * @ctx: File system context
  * @fd: File descriptor
- * @offset: File offset
+ * @iov: Buffers holding the data to write, in order
+ * @iovcnt: Number of buffers in @iov
  *
- * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * Same as fs_write_ctx() on the concatenation of the @iovcnt buffers of @iov,
+ * performed as a single write: the file's chain is walked once and the root
+ * directory and the FAT are updated once for all of them.
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is invalid (out of
+ * bounds or not currently open), or if @iov is NULL or holds no data.
+ * Otherwise return the number of bytes actually written.
  */
-int fs_lseek(int fd, size_t offset)
+int fs_writev_ctx(fs_ctx *ctx, int fd, const struct iovec *iov, int iovcnt)
 {
-	if(!mounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || FD_table[fd].loc == -1 
-	|| offset > (size_t)fs_stat(fd)){
+	long count = fs_iov_size(iov, iovcnt);
+	if(count <= 0){
 		return -1;
 	}
 
-	FD_table[fd].table_offset = offset;
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
+	}
 
-	return 0;
+	pthread_rwlock_wrlock(&ctx->fileLock[root]);
+	int ret = fs_file_write(ctx, fd, root, iov, iovcnt, count, FD_ENTRY(ctx, fd).table_offset);
+	if(ret > 0){
+		FD_ENTRY(ctx, fd).table_offset += ret;
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return ret;
 }
 
 
 /**
- * fs_write - Write to a file
+ * fs_readv_ctx - Read from a file into several buffers
+ * @ctx: File system context
  * @fd: File descriptor
- * @buf: Data buffer to write in the file
- * @count: Number of bytes of data to be written
- *
- * Attempt to write @count bytes of data from buffer pointer by @buf into the
- * file referenced by file descriptor @fd. It is assumed that @buf holds at
- * least @count bytes.
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
  *
- * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
- * runs out of space while performing a write operation, fs_write() should write
- * as many bytes as possible. The number of written bytes can therefore be
- * smaller than @count (it can even be 0 if there is no more space on disk).
+ * Same as fs_read_ctx() into the concatenation of the @iovcnt buffers of @iov,
+ * performed as a single read that walks the file's chain once.
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is invalid (out of
+ * bounds or not currently open), or if @iov is NULL or holds no room.
+ * Otherwise return the number of bytes actually read.
  */
-int fs_write(int fd, void *buf, size_t count)
+int fs_readv_ctx(fs_ctx *ctx, int fd, const struct iovec *iov, int iovcnt)
 {
-	if (!mounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || FD_table[fd].loc == -1 
-	|| buf == NULL || count == 0) {
-    	return -1;
+	long count = fs_iov_size(iov, iovcnt);
+	if(count <= 0){
+		return -1;
 	}
 
-	
-	int root = 	FD_table[fd].loc;
-	int amount_written = 0;
-	int bytes = 0;
-	int offset = FD_table[fd].table_offset;
-	int first = offset / BLOCK_SIZE;
-	int block_offset;
-	if (offset % BLOCK_SIZE == 0) {
-    	block_offset = 0;
-	} else {
-    	block_offset = offset - (first * BLOCK_SIZE);
+	int root = fs_fd_get(ctx, fd);
+	if(root == -1){
+		return -1;
 	}
 
-	uint16_t first_data_block = rootDir[root].index_first;
-	uint32_t file_size = rootDir[root].file_size;
-	uint8_t written[BLOCK_SIZE];
+	pthread_rwlock_rdlock(&ctx->fileLock[root]);
+	int ret = fs_file_read(ctx, fd, root, iov, iovcnt, count, FD_ENTRY(ctx, fd).table_offset);
+	if(ret > 0){
+		FD_ENTRY(ctx, fd).table_offset += ret;
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
 
+	return ret;
+}
 
-	if(first_data_block == FAT_EOC){
-		for(int i = 0; i < superblock.dataBlkAmt; i++){
-			if(FAT_array[i]  == 0){
-				first_data_block = i;
-				rootDir[root].index_first = first_data_block;
-				FAT_array[first_data_block] = FAT_EOC;
-
-				if(block_write(superblock.rootIndex, &rootDir) == -1){
-					return 0;
-				}
-			}
-		}
 
+/**
+ * fs_pread_ctx - Read from a file at a given offset
+ * @ctx: File system context
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read_ctx(), but read from @offset and leave the file offset of
+ * descriptor @fd unchanged. Several threads can read through the same
+ * descriptor at once.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is invalid (out of
+ * bounds or not currently open), or if @buf is NULL. Otherwise return the
+ * number of bytes actually read.
+ */
+int fs_pread_ctx(fs_ctx *ctx, int fd, void *buf, size_t count, size_t offset)
+{
+	if (buf == NULL || count == 0) {
+    	return -1;
 	}
 
-	int curr = first_data_block;
-	int prev = first_data_block;
+	int root = fs_fd_lock(ctx, fd, 1);
+	if(root == -1){
+		return -1;
+	}
 
-	for(int i = 0; i < first; i++){
-		prev = curr;
-		curr = FAT_array[curr];
-	} 
+	// the descriptor's cursor belongs to fs_read_ctx() and fs_write_ctx()
+	struct iovec vec = { buf, count };
+	int ret = 0;
+	pthread_rwlock_rdlock(&ctx->fileLock[root]);
+	if(offset < ctx->rootDir[root].file_size){
+		ret = fs_file_read(ctx, -1, root, &vec, 1, count, offset);
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
 
+	return ret;
+}
 
-	while(count > 0){
-		if(curr == FAT_EOC){
-			for(int i = 0; i < superblock.dataBlkAmt; i++){
-				if(FAT_array[i]  == 0){
-					FAT_array[prev] = i;
-					curr = i;
-					FAT_array[curr] = FAT_EOC;
-					break;
-				}
-			}
 
-		}
+/**
+ * fs_pwrite_ctx - Write to a file at a given offset
+ * @ctx: File system context
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write_ctx(), but write at @offset and leave the file offset of
+ * descriptor @fd unchanged. Writes through the same descriptor from several
+ * threads do not interfere, although writes to the same file are still
+ * performed one at a time.
+ *
+ * Return: -1 if @ctx is NULL, or if file descriptor @fd is invalid (out of
+ * bounds or not currently open), or if @buf is NULL, or if @offset is larger
+ * than the current file size. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_pwrite_ctx(fs_ctx *ctx, int fd, void *buf, size_t count, size_t offset)
+{
+	if (buf == NULL || count == 0) {
+    	return -1;
+	}
 
-		if(block_read(curr + superblock.dataIndex, &written) == -1){
-			break;
-		}
+	int root = fs_fd_lock(ctx, fd, 1);
+	if(root == -1){
+		return -1;
+	}
 
-		if((int)count < (BLOCK_SIZE - block_offset)){
-			bytes = count;
-		} else {
-			bytes = BLOCK_SIZE - block_offset;
-		}
+	struct iovec vec = { buf, count };
+	int ret = -1;
+	pthread_rwlock_wrlock(&ctx->fileLock[root]);
+	if(offset <= ctx->rootDir[root].file_size){
+		ret = fs_file_write(ctx, -1, root, &vec, 1, count, offset);
+	}
+	pthread_rwlock_unlock(&ctx->fileLock[root]);
+	fs_fd_put(ctx, fd);
+
+	return ret;
+}
 
+// queue asynchronous request @aio on file system @ctx, starting the workers
+// if they are not running yet
+int fs_aio_submit(fs_ctx *ctx, struct fs_aio *aio, int write){
+	if(ctx == NULL || aio == NULL || aio->buf == NULL || aio->count == 0){
+		return -1;
+	}
 
-		memcpy(&written[block_offset], buf + amount_written, bytes);
+	aio->ctx = ctx;
+	aio->write = write;
+	aio->next = NULL;
+	aio->result = 0;
+	aio->done = 0;
 
-		if(block_write(curr + superblock.dataIndex, written) == -1){
-			return 0;
+	pthread_mutex_lock(&ctx->aioLock);
+	while(ctx->aioStarted < FS_AIO_WORKERS){
+		if(pthread_create(&ctx->aioWorkers[ctx->aioStarted], NULL, fs_aio_worker, ctx) != 0){
+			break;
 		}
-
-		block_offset = 0;
-		amount_written += bytes;
-		count -= bytes;
-		offset += bytes;
-		prev = curr;
-		curr = FAT_array[prev];
+		ctx->aioStarted++;
+	}
+	if(ctx->aioStarted == 0){
+		pthread_mutex_unlock(&ctx->aioLock);
+		return -1;
 	}
 
-	if (offset > (int)file_size) {
-    	rootDir[root].file_size = offset;
+	if(ctx->aioTail == NULL){
+		ctx->aioHead = aio;
 	} else {
-    	rootDir[root].file_size = file_size;
+		ctx->aioTail->next = aio;
 	}
+	ctx->aioTail = aio;
+	pthread_cond_signal(&ctx->aioQueued);
+	pthread_mutex_unlock(&ctx->aioLock);
 
-	FD_table[fd].table_offset = offset;
+	return 0;
+}
 
-	if(block_write(superblock.rootIndex, rootDir) == -1){
-		return 0;
-	}
 
+/**
+ * fs_read_async_ctx - Start reading from a file
+ * @ctx: File system context
+ * @aio: Request, with @aio->fd, @aio->buf, @aio->count, @aio->offset and
+ * @aio->callback set
+ *
+ * Queue a read of @aio->count bytes at offset @aio->offset of the file
+ * referenced by descriptor @aio->fd into @aio->buf, and return without waiting
+ * for it. The read is performed by a worker thread of the file system as
+ * fs_pread_ctx() would, and its result is stored in @aio->result. When
+ * @aio->callback is set, it is then called from the worker thread and the file
+ * system no longer touches @aio. Otherwise, the completion can be checked with
+ * fs_aio_poll() or waited for with fs_aio_wait().
+ *
+ * Return: -1 if @ctx is NULL, or if @aio is NULL, or if @aio->buf is NULL or
+ * @aio->count is 0, or if no worker thread can be started. 0 otherwise.
+ */
+int fs_read_async_ctx(fs_ctx *ctx, struct fs_aio *aio)
+{
+	return fs_aio_submit(ctx, aio, 0);
+}
 
-	uint16_t buffer[Half];
-	for(int i = 1; i <= superblock.fatBlkAmt; i++){
-		block_write(i, &FAT_array[(i-1)*Half]);
-		block_read(i, buffer);
-	}
 
-	return amount_written;
+/**
+ * fs_write_async_ctx - Start writing to a file
+ * @ctx: File system context
+ * @aio: Request, with @aio->fd, @aio->buf, @aio->count, @aio->offset and
+ * @aio->callback set
+ *
+ * Same as fs_read_async_ctx(), but write @aio->count bytes from @aio->buf at
+ * offset @aio->offset as fs_pwrite_ctx() would.
+ *
+ * Return: -1 if @ctx is NULL, or if @aio is NULL, or if @aio->buf is NULL or
+ * @aio->count is 0, or if no worker thread can be started. 0 otherwise.
+ */
+int fs_write_async_ctx(fs_ctx *ctx, struct fs_aio *aio)
+{
+	return fs_aio_submit(ctx, aio, 1);
 }
 
 
 /**
- * fs_read - Read from a file
- * @fd: File descriptor
- * @buf: Data buffer to be filled with data
- * @count: Number of bytes of data to be read
- *
- * Attempt to read @count bytes of data from the file referenced by file
- * descriptor @fd into buffer pointer by @buf. It is assumed that @buf is large
- * enough to hold at least @count bytes.
+ * fs_aio_poll - Check whether an asynchronous request completed
+ * @aio: Request started without callback
  *
- * The number of bytes read can be smaller than @count if there are less than
- * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * Return: 1 if request @aio completed, in which case @aio->result holds its
+ * result. 0 otherwise.
+ */
+int fs_aio_poll(struct fs_aio *aio)
+{
+	fs_ctx *ctx = aio->ctx;
+
+	pthread_mutex_lock(&ctx->aioLock);
+	int done = aio->done;
+	pthread_mutex_unlock(&ctx->aioLock);
+
+	return done;
+}
+
+
+/**
+ * fs_aio_wait - Wait for an asynchronous request to complete
+ * @aio: Request started without callback
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * Return: the result of request @aio, as fs_pread() or fs_pwrite() would
+ * return it.
  */
-int fs_read(int fd, void *buf, size_t count)
+int fs_aio_wait(struct fs_aio *aio)
 {
-	if (!mounted || fd >= FS_OPEN_MAX_COUNT || fd < 0 || FD_table[fd].loc == -1 
-	|| buf == NULL || count == 0) {
-    	return -1;
-	}
+	fs_ctx *ctx = aio->ctx;
 
-	int root = 	FD_table[fd].loc;
-	int offset = FD_table[fd].table_offset;
-	int first = offset / BLOCK_SIZE;
-	int block_offset;
-	if (offset % BLOCK_SIZE == 0) {
-    	block_offset = 0;
-	} else {
-    	block_offset = offset - (first * BLOCK_SIZE);
+	pthread_mutex_lock(&ctx->aioLock);
+	while(!aio->done){
+		pthread_cond_wait(&ctx->aioDone, &ctx->aioLock);
 	}
-	int amount = (count / BLOCK_SIZE) + (count % BLOCK_SIZE != 0);
-	int amount_read = 0;
-	int blocks_read = 0;
-	int bytes = 0;
+	pthread_mutex_unlock(&ctx->aioLock);
+
+	return aio->result;
+}
 
-	uint16_t first_data_block = rootDir[root].index_first;
-	uint32_t file_size = rootDir[root].file_size;
-	uint8_t read[BLOCK_SIZE];
 
+/*
+ * Single file system API: the same calls, working on the file system mounted by
+ * fs_mount() or fs_mount_opts()
+ */
 
-	int curr = first_data_block;
+int fs_mount(const char *diskname)
+{
+	return fs_mount_opts(diskname, NULL);
+}
 
-	for(int i = 0; i < first; i++){
-		curr = FAT_array[curr];
+int fs_mount_opts(const char *diskname, const struct fs_options *opts)
+{
+	if(defaultCtx != NULL){
+		return -1;
 	}
 
-	while(amount_read < amount){
-		if(curr == FAT_EOC){
-			break;
-		}
+	defaultCtx = fs_mount_ctx(diskname, opts);
+	if(defaultCtx == NULL){
+		return -1;
+	}
 
-		if(block_read(curr + superblock.dataIndex, read) == -1){
-			break;
-		}
+	return 0;
+}
 
-		if((int)count < (BLOCK_SIZE - block_offset)){
-			bytes = count;
-		} else {
-			bytes = BLOCK_SIZE - block_offset;
-		}
+int fs_umount(void)
+{
+	if(fs_umount_ctx(defaultCtx) == -1){
+		return -1;
+	}
 
-		if (bytes + offset > (int)file_size) {
-    		bytes = file_size - offset;
-		}
+	defaultCtx = NULL;
+	return 0;
+}
 
-		memcpy(buf + amount_read, &read[block_offset], bytes);
+int fs_sync(void)
+{
+	return fs_sync_ctx(defaultCtx);
+}
 
-		amount_read += bytes;
-		count -= bytes;
-		offset += bytes;
-		block_offset = 0;
-		blocks_read++;
-		curr = FAT_array[curr];
-	}
+int fs_fsync(int fd)
+{
+	return fs_fsync_ctx(defaultCtx, fd);
+}
 
-	FD_table[fd].table_offset += offset;
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+	return fs_cache_stats_ctx(defaultCtx, stats);
+}
 
-	return amount_read;
+int fs_info(void)
+{
+	return fs_info_ctx(defaultCtx);
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_ctx(defaultCtx, filename);
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_ctx(defaultCtx, filename);
+}
+
+int fs_reclaim(size_t max_blocks)
+{
+	return fs_reclaim_ctx(defaultCtx, max_blocks);
+}
+
+int fs_ls(void)
+{
+	return fs_ls_ctx(defaultCtx);
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_ctx(defaultCtx, filename);
+}
+
+int fs_close(int fd)
+{
+	return fs_close_ctx(defaultCtx, fd);
+}
+
+int fs_stat(int fd)
+{
+	return fs_stat_ctx(defaultCtx, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_ctx(defaultCtx, fd, offset);
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	return fs_fallocate_ctx(defaultCtx, fd, size);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_ctx(defaultCtx, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_ctx(defaultCtx, fd, buf, count);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pread_ctx(defaultCtx, fd, buf, count, offset);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pwrite_ctx(defaultCtx, fd, buf, count, offset);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_writev_ctx(defaultCtx, fd, iov, iovcnt);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_readv_ctx(defaultCtx, fd, iov, iovcnt);
+}
+
+int fs_read_async(struct fs_aio *aio)
+{
+	return fs_read_async_ctx(defaultCtx, aio);
+}
+
+int fs_write_async(struct fs_aio *aio)
+{
+	return fs_write_async_ctx(defaultCtx, aio);
 }
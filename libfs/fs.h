@@ -1,11 +1,8 @@
 #ifndef _FS_H
 #define _FS_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
- */
-
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -16,6 +13,101 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Mount flag: access the virtual disk through a memory mapping */
+#define FS_MOUNT_MMAP 0x1
+/** Mount flag: submit block batches asynchronously through io_uring */
+#define FS_MOUNT_URING 0x2
+/** Mount flag: bypass the host page cache when accessing the virtual disk */
+#define FS_MOUNT_DIRECT 0x4
+/** Mount flag: keep root directory and FAT updates in memory until synced */
+#define FS_MOUNT_LAZY 0x8
+/** Mount flag: log root directory and FAT updates to an on-disk journal */
+#define FS_MOUNT_JOURNAL 0x10
+/** Mount flag: leave the blocks of deleted files to fs_reclaim() */
+#define FS_MOUNT_DEFER_FREE 0x20
+/** Mount flag: write dirty blocks back from a background thread */
+#define FS_MOUNT_FLUSH 0x40
+/** Mount flag: map the FAT and only read its blocks when first accessed */
+#define FS_MOUNT_PAGED_FAT 0x80
+
+/**
+ * struct fs_options - Mount options
+ * @flags: Bitwise OR of FS_MOUNT_* flags
+ * @cache_blocks: Number of data blocks held by the write-back block cache (0
+ * disables the cache)
+ * @open_max: Maximum number of file descriptors open at once (0 for
+ * %FS_OPEN_MAX_COUNT). The descriptor table grows on demand up to that limit.
+ * @flush_age_ms: With %FS_MOUNT_FLUSH, age in milliseconds from which dirty
+ * blocks and pending metadata updates are written back (0 for 1000)
+ * @flush_ratio: With %FS_MOUNT_FLUSH, percentage of the cache that can be dirty
+ * before the flusher is woken up early (0 for 25)
+ */
+struct fs_options {
+	int flags;
+	size_t cache_blocks;
+	size_t open_max;
+	unsigned int flush_age_ms;
+	unsigned int flush_ratio;
+};
+
+/**
+ * struct fs_cache_stats - Block cache counters
+ * @hits: Number of data block accesses served from the cache
+ * @misses: Number of data block accesses that had to go to the disk
+ * @writebacks: Number of dirty data blocks written back to the disk
+ * @dirty: Number of dirty data blocks waiting to be written back
+ * @flushes: Number of writes issued by the background flusher
+ * @flush_us: Total time spent in those writes, in microseconds
+ * @flush_us_max: Longest of those writes, in microseconds
+ */
+struct fs_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t writebacks;
+	size_t dirty;
+	size_t flushes;
+	size_t flush_us;
+	size_t flush_us_max;
+};
+
+/**
+ * typedef fs_ctx - Mounted file system
+ *
+ * Opaque handle returned by fs_mount_ctx(). Each context has its own virtual
+ * disk, block cache, root directory, FAT and file descriptors, so a process can
+ * keep several file systems mounted at once and use them from any thread.
+ */
+typedef struct fs_ctx fs_ctx;
+
+/**
+ * struct fs_aio - Asynchronous request
+ * @fd: File descriptor
+ * @buf: Data buffer to read into or write from
+ * @count: Number of bytes of data to transfer
+ * @offset: File offset of the transfer
+ * @callback: Function called from a worker thread once the request completed,
+ * or NULL to use fs_aio_poll() and fs_aio_wait()
+ * @data: Free for the caller, typically to find its context from @callback
+ * @result: Set to what fs_pread() or fs_pwrite() would return
+ *
+ * The remaining fields are private to the file system. The structure must stay
+ * valid until the request completed.
+ */
+struct fs_aio {
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	void (*callback)(struct fs_aio *aio);
+	void *data;
+	int result;
+
+	fs_ctx *ctx;
+	int write;
+	int done;
+	struct fs_aio *next;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -24,22 +116,101 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Once mounted, the file system can be used by several threads at once:
+ * accesses to different files proceed in parallel, and reads of the same file
+ * only wait for its writers. Mounting and unmounting must not run concurrently
+ * with any other call.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_opts - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but lets the caller tune how the file system is accessed.
+ * With %FS_MOUNT_MMAP, the virtual disk is memory-mapped: reads are served
+ * straight from the mapping and modifications are only flushed to the disk
+ * file when the file system is unmounted or synced. Otherwise, a non-zero
+ * @opts->cache_blocks puts a write-back cache of that many blocks in front of
+ * the file data blocks (a mapped disk does not need one). With %FS_MOUNT_URING,
+ * the blocks of a file that a read or write spans are submitted to the disk
+ * together through io_uring (when the kernel supports it). With
+ * %FS_MOUNT_DIRECT, the virtual disk is accessed with direct I/O, bypassing the
+ * host page cache; combine it with @opts->cache_blocks to keep hot blocks in
+ * memory. With %FS_MOUNT_LAZY, changes to the root directory and the FAT are
+ * only written to the disk by fs_sync(), fs_fsync() and fs_umount(). With
+ * %FS_MOUNT_JOURNAL, a journal is reserved at the end of the data blocks if
+ * the disk does not have one yet. Once a disk has a journal, metadata updates
+ * are committed to it in groups before being written in place, and the last
+ * committed group is replayed when the disk is mounted after a crash. With
+ * %FS_MOUNT_DEFER_FREE, fs_delete() returns without releasing the blocks of
+ * the file, see fs_reclaim(). With %FS_MOUNT_FLUSH, a background thread writes
+ * back, in block order, the cached blocks dirty for @opts->flush_age_ms, and
+ * the oldest ones as soon as more than @opts->flush_ratio percent of the cache
+ * is dirty, so that fs_write() does not wait for the disk. Pending metadata
+ * updates (see %FS_MOUNT_LAZY and %FS_MOUNT_JOURNAL) are written back once
+ * they are as old. The thread stops when the file system is unmounted.
+ * With %FS_MOUNT_PAGED_FAT, the FAT is mapped rather than read at mount time:
+ * each of its blocks is only read from the disk when a chain first crosses it,
+ * so that mounting a large disk and opening a file only costs the FAT blocks
+ * used. The free blocks are then counted at mount time only if the disk was
+ * not cleanly unmounted.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
  * disk file.
+ * The numbers of free data blocks and free root directory entries are saved
+ * in the superblock, so that the next mount does not have to count them.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Flush file system to disk
+ *
+ * Write back the pending root directory and FAT updates and every dirty block
+ * held in the block cache, then flush the virtual disk file.
+ *
+ * Return: -1 if no FS is currently mounted, or if the blocks cannot be written
+ * back. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Flush a file to disk
+ * @fd: File descriptor
+ *
+ * Make the contents and the size of the file referenced by file descriptor @fd
+ * durable. The root directory and the FAT are shared by all files, so the
+ * pending updates to them are written back as a whole.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the blocks cannot be
+ * written back. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
 /**
  * fs_info - Display information about file system
  *
@@ -77,6 +248,22 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_reclaim - Release the blocks of deleted files
+ * @max_blocks: Maximum number of blocks to release, or 0 for all of them
+ *
+ * When the file system is mounted with %FS_MOUNT_DEFER_FREE, fs_delete() only
+ * removes the file from the root directory and leaves its data blocks to this
+ * function, so that it can be called when the application is idle. Blocks
+ * that are still pending are also released when the disk runs out of free
+ * blocks and when the file system is unmounted, or by the next mount if the
+ * process ends without unmounting it.
+ *
+ * Return: -1 if no FS is currently mounted, or if the FAT cannot be written
+ * back. Otherwise, the number of blocks released.
+ */
+int fs_reclaim(size_t max_blocks);
+
 /**
  * fs_ls - List files on file system
  *
@@ -96,11 +283,12 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, unless the file system was mounted with a different
+ * @opts->open_max.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * there is no file named @filename to open, or if the maximum number of files
+ * are currently open. Otherwise, return the file
  * descriptor.
  */
 int fs_open(const char *filename);
@@ -143,6 +331,23 @@ int fs_stat(int fd);
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes to reserve
+ *
+ * Make sure the file referenced by file descriptor @fd has data blocks for at
+ * least @size bytes, allocating the missing blocks as one contiguous extent
+ * next to the file's last block whenever the free space allows it. The file
+ * size is left unchanged: the reserved blocks are used by subsequent writes
+ * past the end of the file, which then stream to consecutive disk blocks.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there is not enough free
+ * space on disk. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -186,4 +391,180 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset and leave the file offset of
+ * descriptor @fd unchanged. Several threads can read through the same
+ * descriptor at once, for example to fetch different ranges of a large file in
+ * parallel.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset and leave the file offset of
+ * descriptor @fd unchanged. Writes through the same descriptor from several
+ * threads do not interfere, although writes to the same file are still
+ * performed one at a time.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers holding the data to write, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() on the concatenation of the @iovcnt buffers of @iov, for
+ * example a record header and its payload. The buffers are written as a single
+ * operation: the file's chain is walked once and the root directory and the
+ * FAT are updated once for all of them.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL or holds no
+ * data. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read() into the concatenation of the @iovcnt buffers of @iov,
+ * performed as a single read that walks the file's chain once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL or holds no
+ * room. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_read_async - Start reading from a file
+ * @aio: Request, with @aio->fd, @aio->buf, @aio->count, @aio->offset and
+ * @aio->callback set
+ *
+ * Queue a read of @aio->count bytes at offset @aio->offset of the file
+ * referenced by descriptor @aio->fd into @aio->buf, and return without waiting
+ * for it. The read is performed by a worker thread of the file system as
+ * fs_pread() would, and its result is stored in @aio->result. When
+ * @aio->callback is set, it is then called from the worker thread and the file
+ * system no longer touches @aio. Otherwise, the completion can be checked with
+ * fs_aio_poll() or waited for with fs_aio_wait(). The worker threads are
+ * started by the first request and stopped by fs_umount(), which lets them
+ * finish the queued requests first.
+ *
+ * Return: -1 if no FS is currently mounted, or if @aio is NULL, or if
+ * @aio->buf is NULL or @aio->count is 0, or if no worker thread can be
+ * started. 0 otherwise.
+ */
+int fs_read_async(struct fs_aio *aio);
+
+/**
+ * fs_write_async - Start writing to a file
+ * @aio: Request, with @aio->fd, @aio->buf, @aio->count, @aio->offset and
+ * @aio->callback set
+ *
+ * Same as fs_read_async(), but write @aio->count bytes from @aio->buf at offset
+ * @aio->offset as fs_pwrite() would.
+ *
+ * Return: -1 if no FS is currently mounted, or if @aio is NULL, or if
+ * @aio->buf is NULL or @aio->count is 0, or if no worker thread can be
+ * started. 0 otherwise.
+ */
+int fs_write_async(struct fs_aio *aio);
+
+/**
+ * fs_aio_poll - Check whether an asynchronous request completed
+ * @aio: Request started without callback
+ *
+ * Return: 1 if request @aio completed, in which case @aio->result holds its
+ * result. 0 otherwise.
+ */
+int fs_aio_poll(struct fs_aio *aio);
+
+/**
+ * fs_aio_wait - Wait for an asynchronous request to complete
+ * @aio: Request started without callback
+ *
+ * Return: the result of request @aio, as fs_pread() or fs_pwrite() would
+ * return it.
+ */
+int fs_aio_wait(struct fs_aio *aio);
+
+/*
+ * Context-based API
+ *
+ * The functions above work on a single default file system, mounted with
+ * fs_mount() or fs_mount_opts(). Each of them has a counterpart taking the
+ * context of the file system to work on as first argument, which otherwise
+ * behaves the same. File descriptors are local to a context.
+ */
+
+/**
+ * fs_mount_ctx - Mount a file system and return its context
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount_opts(), but any number of virtual disks can be mounted at
+ * once, as long as each is mounted only once.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The context of the file system otherwise.
+ */
+fs_ctx *fs_mount_ctx(const char *diskname, const struct fs_options *opts);
+
+/**
+ * fs_umount_ctx - Unmount a file system and release its context
+ * @ctx: File system context
+ *
+ * Return: -1 if @ctx is NULL, or if there are still open file descriptors, or
+ * if the pending updates cannot be written back, in which case @ctx stays
+ * mounted. 0 otherwise, and @ctx can no longer be used.
+ */
+int fs_umount_ctx(fs_ctx *ctx);
+
+int fs_sync_ctx(fs_ctx *ctx);
+int fs_fsync_ctx(fs_ctx *ctx, int fd);
+int fs_cache_stats_ctx(fs_ctx *ctx, struct fs_cache_stats *stats);
+int fs_info_ctx(fs_ctx *ctx);
+int fs_create_ctx(fs_ctx *ctx, const char *filename);
+int fs_delete_ctx(fs_ctx *ctx, const char *filename);
+int fs_reclaim_ctx(fs_ctx *ctx, size_t max_blocks);
+int fs_ls_ctx(fs_ctx *ctx);
+int fs_open_ctx(fs_ctx *ctx, const char *filename);
+int fs_close_ctx(fs_ctx *ctx, int fd);
+int fs_stat_ctx(fs_ctx *ctx, int fd);
+int fs_lseek_ctx(fs_ctx *ctx, int fd, size_t offset);
+int fs_fallocate_ctx(fs_ctx *ctx, int fd, size_t size);
+int fs_write_ctx(fs_ctx *ctx, int fd, void *buf, size_t count);
+int fs_read_ctx(fs_ctx *ctx, int fd, void *buf, size_t count);
+int fs_pread_ctx(fs_ctx *ctx, int fd, void *buf, size_t count, size_t offset);
+int fs_pwrite_ctx(fs_ctx *ctx, int fd, void *buf, size_t count, size_t offset);
+int fs_writev_ctx(fs_ctx *ctx, int fd, const struct iovec *iov, int iovcnt);
+int fs_readv_ctx(fs_ctx *ctx, int fd, const struct iovec *iov, int iovcnt);
+int fs_read_async_ctx(fs_ctx *ctx, struct fs_aio *aio);
+int fs_write_async_ctx(fs_ctx *ctx, struct fs_aio *aio);
+
 #endif /* _FS_H */
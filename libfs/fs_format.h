@@ -0,0 +1,73 @@
+#ifndef _FS_FORMAT_H
+#define _FS_FORMAT_H
+
+/*
+ * On-disk layout of the file system, shared by the library and the tests that
+ * inspect or damage images directly. Not part of the public API.
+ */
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/** Signature of the superblock */
+#define FS_SIGNATURE "ECS150FS"
+/** Signature of a journal header */
+#define JOURNAL_SIGNATURE "ECS150JL"
+/** Initial value of fs_journal_sum() */
+#define JOURNAL_SUM_SEED 2166136261u
+
+// root directory block plus the largest possible FAT (65535 entries)
+#define JOURNAL_MAX_BLOCKS 33
+
+// first block of the file system
+typedef struct SUPERBLOCK 
+{
+	char signature[8];
+	uint16_t virBlkAmt;
+	uint16_t rootIndex;
+	uint16_t dataIndex;
+	uint16_t dataBlkAmt;
+	uint8_t fatBlkAmt;
+	uint8_t journalBlkAmt; // 0 when the disk has no journal
+	uint16_t journalIndex; // first block of the journal
+	// free counters saved by the last clean unmount, so mounting does not have
+	// to count them
+	uint16_t fatFree;
+	uint8_t rootFree;
+	uint8_t clean; // set by a clean unmount, cleared by the next metadata update
+	uint32_t rootSum; // FNV-1a of the root directory at that unmount
+	uint8_t padding[BLOCK_SIZE - 28];
+} sb;
+
+// root directory stores 128 entries
+// ENTRY
+typedef struct ROOT 
+{
+	char filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint16_t index_first;
+	uint8_t padding[10]; // size of entry (32) - 10
+} rd;
+
+// first block of the journal, followed by the logged copies of the blocks
+typedef struct JOURNAL
+{
+	char signature[8];
+	uint32_t sequence;
+	uint32_t checksum; // FNV-1a of the logged blocks
+	uint16_t count; // number of logged blocks, 0 once they are in place
+	uint16_t targets[JOURNAL_MAX_BLOCKS]; // where each logged block belongs
+	uint8_t padding[BLOCK_SIZE - 18 - 2 * JOURNAL_MAX_BLOCKS];
+} jh;
+
+/**
+ * fs_journal_sum - FNV-1a hash of @len bytes of @buf, continuing from @hash
+ *
+ * Start from JOURNAL_SUM_SEED. Used for the journal and root directory
+ * checksums.
+ */
+uint32_t fs_journal_sum(uint32_t hash, const void *buf, size_t len);
+
+#endif /* _FS_FORMAT_H */